@@ -20,17 +20,35 @@
 #define _GNU_SOURCE // strdup
 
 #include <argtable2.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
 #include <lilv/lilv.h>
 #include <math.h>
+#include <pthread.h>
+#include <limits.h>
 #include <regex.h>
+#include <sched.h>
+#include <signal.h>
 #include <sndfile.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "lv2.h"
 #include "lv2/lv2plug.in/ns/ext/atom/atom.h"
+#include "lv2/lv2plug.in/ns/ext/atom/util.h"
 #include "lv2/lv2plug.in/ns/ext/buf-size/buf-size.h"
+#include "lv2/lv2plug.in/ns/ext/midi/midi.h"
 #include "lv2/lv2plug.in/ns/ext/options/options.h"
 #include "lv2/lv2plug.in/ns/ext/presets/presets.h"
 #include "lv2/lv2plug.in/ns/ext/uri-map/uri-map.h"
@@ -43,88 +61,3652 @@ static const size_t atom_capacity = 32768;
  * LV2 URI MAP
  */
 
-static char**   urimap     = NULL;
-static uint32_t urimap_len = 0;
+static char**          urimap      = NULL;
+static uint32_t        urimap_len  = 0;
+static pthread_mutex_t urimap_lock = PTHREAD_MUTEX_INITIALIZER; // state is restored in parallel
 
 static uint32_t
 uri_to_id (LV2_URI_Map_Callback_Data unused, const char* uri)
 {
 	(void)unused;
+	pthread_mutex_lock (&urimap_lock);
 	for (uint32_t i = 0; i < urimap_len; ++i) {
 		if (!strcmp (urimap[i], uri)) {
+			pthread_mutex_unlock (&urimap_lock);
 			return i + 1;
 		}
 	}
 	urimap             = (char**)realloc (urimap, (urimap_len + 1) * sizeof (char*));
 	urimap[urimap_len] = strdup (uri);
-	return ++urimap_len;
+	uint32_t id        = ++urimap_len;
+	pthread_mutex_unlock (&urimap_lock);
+	return id;
+}
+
+/* URIDs used in the processing loop, mapped once when the world is created,
+ * as the jobs of --batch, --watch and --preview share it */
+static LV2_URID urid_atom_Sequence  = 0;
+static LV2_URID urid_atom_Chunk     = 0;
+static LV2_URID urid_midi_MidiEvent = 0;
+
+static void
+free_uri_map ()
+{
+	for (uint32_t i = 0; i < urimap_len; ++i) {
+		free (urimap[i]);
+	}
+	free (urimap);
+}
+
+/* ****************************************************************************
+ * Standard MIDI File input
+ */
+
+struct midievent {
+	sf_count_t frame;
+	uint32_t   tick;
+	uint32_t   order; // position in the file, keeps the sort stable
+	uint32_t   tempo; // microseconds per quarter note, 0 for channel messages
+	uint8_t    size;
+	uint8_t    data[3];
+};
+
+struct midifile {
+	struct midievent* events; // sorted by frame
+	size_t            numevents;
+};
+
+static uint32_t
+read_be (const uint8_t* p, unsigned int n)
+{
+	uint32_t value = 0;
+	for (unsigned int i = 0; i < n; i++) {
+		value = (value << 8) | p[i];
+	}
+	return value;
+}
+
+static bool
+read_vlq (const uint8_t** p, const uint8_t* end, uint32_t* value)
+{
+	uint32_t v = 0;
+	for (int i = 0; i < 4 && *p < end; i++) {
+		uint8_t b = *(*p)++;
+		v         = (v << 7) | (b & 0x7f);
+		if (!(b & 0x80)) {
+			*value = v;
+			return true;
+		}
+	}
+	return false;
+}
+
+static int
+compare_midievents (const void* a, const void* b)
+{
+	const struct midievent* ea = (const struct midievent*)a;
+	const struct midievent* eb = (const struct midievent*)b;
+	if (ea->tick != eb->tick) {
+		return ea->tick < eb->tick ? -1 : 1;
+	}
+	return ea->order < eb->order ? -1 : (ea->order > eb->order);
+}
+
+static bool
+push_midievent (struct midifile* midi, size_t* allocated, struct midievent* ev)
+{
+	if (midi->numevents == *allocated) {
+		size_t            newsize = *allocated ? *allocated * 2 : 1024;
+		struct midievent* events  = (struct midievent*)realloc (midi->events, newsize * sizeof (struct midievent));
+		if (!events) {
+			return false;
+		}
+		midi->events = events;
+		*allocated   = newsize;
+	}
+	ev->order                       = midi->numevents;
+	midi->events[midi->numevents++] = *ev;
+	return true;
+}
+
+static bool
+parse_midi_track (struct midifile* midi, size_t* allocated, const uint8_t* p, const uint8_t* end)
+{
+	uint32_t tick    = 0;
+	uint8_t  running = 0;
+	while (p < end) {
+		uint32_t delta;
+		if (!read_vlq (&p, end, &delta) || p >= end) {
+			return false;
+		}
+		tick += delta;
+		uint8_t status = *p;
+		if (status & 0x80) {
+			p++;
+		} else if (running) {
+			status = running;
+		} else {
+			return false;
+		}
+
+		if (status == 0xFF) {
+			uint32_t len;
+			running = 0;
+			if (p >= end) {
+				return false;
+			}
+			uint8_t type = *p++;
+			if (!read_vlq (&p, end, &len) || len > (uint32_t)(end - p)) {
+				return false;
+			}
+			if (type == 0x2F) {
+				break;
+			}
+			if (type == 0x51 && len == 3) {
+				struct midievent ev = { 0, tick, 0, read_be (p, 3), 0, { 0, 0, 0 } };
+				if (!push_midievent (midi, allocated, &ev)) {
+					return false;
+				}
+			}
+			p += len;
+		} else if (status == 0xF0 || status == 0xF7) {
+			/* SysEx is not forwarded */
+			uint32_t len;
+			running = 0;
+			if (!read_vlq (&p, end, &len) || len > (uint32_t)(end - p)) {
+				return false;
+			}
+			p += len;
+		} else {
+			uint8_t numdata = ((status & 0xE0) == 0xC0) ? 1 : 2;
+			if (end - p < numdata) {
+				return false;
+			}
+			running             = status;
+			struct midievent ev = { 0, tick, 0, 0, numdata + 1, { status, p[0], numdata > 1 ? p[1] : 0 } };
+			if (!push_midievent (midi, allocated, &ev)) {
+				return false;
+			}
+			p += numdata;
+		}
+	}
+	return true;
+}
+
+/* Parse a Standard MIDI File into a list of channel messages,
+ * timestamped in frames at the given sample rate. */
+static bool
+load_midi_file (const char* path, double samplerate, struct midifile* midi)
+{
+	FILE* f = fopen (path, "rb");
+	if (!f) {
+		fprintf (stderr, "Error opening MIDI file %s\n", path);
+		return false;
+	}
+	fseek (f, 0, SEEK_END);
+	long size = ftell (f);
+	fseek (f, 0, SEEK_SET);
+	uint8_t* data = size > 0 ? (uint8_t*)malloc (size) : NULL;
+	if (!data || fread (data, 1, size, f) != (size_t)size) {
+		fprintf (stderr, "Error reading MIDI file %s\n", path);
+		free (data);
+		fclose (f);
+		return false;
+	}
+	fclose (f);
+
+	const uint8_t* end = data + size;
+	if (size < 14 || memcmp (data, "MThd", 4) || read_be (data + 4, 4) < 6) {
+		fprintf (stderr, "%s is not a Standard MIDI File\n", path);
+		free (data);
+		return false;
+	}
+	uint32_t       numtracks = read_be (data + 10, 2);
+	uint32_t       division  = read_be (data + 12, 2);
+	const uint8_t* p         = data + 8 + read_be (data + 4, 4);
+	size_t         allocated = 0;
+	bool           ok        = division != 0;
+
+	midi->events    = NULL;
+	midi->numevents = 0;
+	for (uint32_t track = 0; ok && track < numtracks && end - p >= 8;) {
+		uint32_t len = read_be (p + 4, 4);
+		if (len > (uint32_t)(end - p - 8)) {
+			len = end - p - 8;
+		}
+		if (!memcmp (p, "MTrk", 4)) {
+			ok = parse_midi_track (midi, &allocated, p + 8, p + 8 + len);
+			track++;
+		}
+		p += 8 + len;
+	}
+	free (data);
+	if (!ok) {
+		fprintf (stderr, "Error parsing MIDI file %s\n", path);
+		free (midi->events);
+		midi->events    = NULL;
+		midi->numevents = 0;
+		return false;
+	}
+
+	/* merge all tracks, then walk the tempo map once */
+	qsort (midi->events, midi->numevents, sizeof (struct midievent), compare_midievents);
+	double   seconds    = 0;
+	double   secperqn   = 0.5;
+	double   secpertick = 0;
+	uint32_t lasttick   = 0;
+	if (division & 0x8000) {
+		/* SMPTE timing: -frames per second, ticks per frame */
+		secpertick = 1.0 / ((double)(-(int8_t)(division >> 8)) * (division & 0xFF));
+	}
+	size_t numevents = 0;
+	for (size_t i = 0; i < midi->numevents; i++) {
+		struct midievent* ev = &midi->events[i];
+		seconds += (ev->tick - lasttick) * (secpertick ? secpertick : secperqn / division);
+		lasttick = ev->tick;
+		if (ev->tempo) {
+			secperqn = ev->tempo / 1e6;
+		} else {
+			ev->frame                   = (sf_count_t)llround (seconds * samplerate);
+			midi->events[numevents++] = *ev;
+		}
+	}
+	midi->numevents = numevents;
+	return true;
+}
+
+/* Reset the atom ports of all instances for the next block:
+ * MIDI-capable inputs receive the events of [position, position + numframes),
+ * other inputs an empty sequence, and outputs get their full capacity back. */
+static void
+prepare_atom_buffers (unsigned int numplugins, unsigned int numatomin, unsigned int numatomout, LV2_Atom_Sequence* seq_in[numplugins][numatomin], const bool midiports[numatomin], LV2_Atom_Sequence* seq_out[numplugins][numatomout], const struct midifile* midi, size_t* nextevent, sf_count_t position, sf_count_t numframes)
+{
+	const LV2_Atom_Sequence* forged = NULL;
+	for (unsigned int port = 0; port < numatomin; port++) {
+		for (unsigned int plugnum = 0; plugnum < numplugins; plugnum++) {
+			LV2_Atom_Sequence* seq = seq_in[plugnum][port];
+			if (forged && midiports[port]) {
+				memcpy (seq, forged, sizeof (LV2_Atom) + forged->atom.size);
+				continue;
+			}
+			seq->atom.size = sizeof (LV2_Atom_Sequence_Body);
+			if (!midiports[port] || !midi->numevents) {
+				continue;
+			}
+			while (*nextevent < midi->numevents && midi->events[*nextevent].frame < position + numframes) {
+				const struct midievent* ev = &midi->events[*nextevent];
+				struct {
+					LV2_Atom_Event event;
+					uint8_t        msg[3];
+				} atomevent;
+				atomevent.event.time.frames = ev->frame > position ? ev->frame - position : 0;
+				atomevent.event.body.size   = ev->size;
+				atomevent.event.body.type   = urid_midi_MidiEvent;
+				memcpy (atomevent.msg, ev->data, sizeof (atomevent.msg));
+				/* events that do not fit are dropped rather than delayed */
+				lv2_atom_sequence_append_event (seq, atom_capacity, &atomevent.event);
+				++*nextevent;
+			}
+			forged = seq;
+		}
+	}
+	for (unsigned int port = 0; port < numatomout; port++) {
+		for (unsigned int plugnum = 0; plugnum < numplugins; plugnum++) {
+			seq_out[plugnum][port]->atom.size = atom_capacity;
+			seq_out[plugnum][port]->atom.type = urid_atom_Chunk;
+		}
+	}
+}
+
+/* ****************************************************************************
+ * CPU placement
+ *
+ * --cpus confines the work to a list of CPUs, and --numa keeps every job on
+ * one NUMA node.  The thread that runs a job, the main thread or a worker of
+ * --watch and --preview, is pinned to a CPU of its own when it starts its
+ * first job, spreading the threads over the nodes, and keeps it.  The reader,
+ * writer and state threads it starts may run on all CPUs of the same node.
+ * The buffers of a job are allocated and first written by its own threads
+ * after that, so the kernel places them on the node, and the instance pool
+ * only hands out instances created on the node.  The nodes are read from
+ * sysfs.
+ */
+
+#define MAX_NODES 64
+
+static struct {
+	bool         enabled, numa;
+	cpu_set_t    cpus; // --cpus, or all the process may use
+	unsigned int numnodes;
+	cpu_set_t    nodes[MAX_NODES]; // CPUs of cpus on every node
+	int          nodeids[MAX_NODES];
+	unsigned int nextslot;
+} placement;
+
+/* where the jobs of this thread run, -1 when it is not pinned */
+static __thread int       placement_cpu = -1, placement_node = -1;
+static __thread cpu_set_t placement_helpers;
+
+/* Parse a CPU list like "0-3,8,10-11", the format of sysfs and taskset */
+static bool
+parse_cpulist (const char* text, cpu_set_t* set)
+{
+	CPU_ZERO (set);
+	for (const char* p = text; *p && *p != '\n';) {
+		char* end;
+		long  first = strtol (p, &end, 10), last = first;
+		if (end == p) {
+			return false;
+		}
+		if (*end == '-') {
+			p    = end + 1;
+			last = strtol (p, &end, 10);
+			if (end == p) {
+				return false;
+			}
+		}
+		if (first < 0 || last < first || last >= CPU_SETSIZE || (*end && *end != ',' && *end != '\n')) {
+			return false;
+		}
+		for (long cpu = first; cpu <= last; cpu++) {
+			CPU_SET (cpu, set);
+		}
+		p = *end == ',' ? end + 1 : end;
+	}
+	return CPU_COUNT (set) > 0;
+}
+
+static void
+format_cpulist (const cpu_set_t* set, char* text, size_t size)
+{
+	size_t length = 0;
+	text[0]       = 0;
+	for (int cpu = 0; cpu < CPU_SETSIZE && length < size; cpu++) {
+		if (!CPU_ISSET (cpu, set)) {
+			continue;
+		}
+		int last = cpu;
+		while (last + 1 < CPU_SETSIZE && CPU_ISSET (last + 1, set)) {
+			last++;
+		}
+		if (last > cpu) {
+			length += snprintf (text + length, size - length, "%s%d-%d", length ? "," : "", cpu, last);
+		} else {
+			length += snprintf (text + length, size - length, "%s%d", length ? "," : "", cpu);
+		}
+		cpu = last;
+	}
+}
+
+/* The CPUs of every NUMA node within placement.cpus, in the order of the
+ * nodes.  Returns the number of nodes. */
+static unsigned int
+placement_read_nodes (void)
+{
+	DIR* dir = opendir ("/sys/devices/system/node");
+	if (!dir) {
+		return 0;
+	}
+	unsigned int   numnodes = 0;
+	struct dirent* entry;
+	while ((entry = readdir (dir)) && numnodes < MAX_NODES) {
+		int  id;
+		char rest;
+		if (sscanf (entry->d_name, "node%d%c", &id, &rest) != 1) {
+			continue;
+		}
+		char path[PATH_MAX], list[4096];
+		snprintf (path, sizeof (path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+		FILE*     file = fopen (path, "r");
+		cpu_set_t cpus;
+		bool      ok = file && fgets (list, sizeof (list), file) && parse_cpulist (list, &cpus);
+		if (file) {
+			fclose (file);
+		}
+		if (!ok) {
+			continue;
+		}
+		CPU_AND (&cpus, &cpus, &placement.cpus);
+		if (!CPU_COUNT (&cpus)) {
+			continue;
+		}
+		/* insertion by id */
+		unsigned int i = numnodes++;
+		for (; i > 0 && placement.nodeids[i - 1] > id; i--) {
+			placement.nodes[i]   = placement.nodes[i - 1];
+			placement.nodeids[i] = placement.nodeids[i - 1];
+		}
+		placement.nodes[i]   = cpus;
+		placement.nodeids[i] = id;
+	}
+	closedir (dir);
+	return numnodes;
+}
+
+/* Set up --cpus and --numa, and confine the process to the CPUs */
+static bool
+placement_init (const char* cpus, bool numa)
+{
+	if (cpus && !parse_cpulist (cpus, &placement.cpus)) {
+		fprintf (stderr, "Error: Invalid CPU list %s\n", cpus);
+		return false;
+	}
+	if (!cpus && sched_getaffinity (0, sizeof (cpu_set_t), &placement.cpus)) {
+		fprintf (stderr, "Error: Unable to get the CPUs of the process: %s\n", strerror (errno));
+		return false;
+	}
+	/* the kernel leaves out CPUs that are offline */
+	if (sched_setaffinity (0, sizeof (cpu_set_t), &placement.cpus) || sched_getaffinity (0, sizeof (cpu_set_t), &placement.cpus)) {
+		fprintf (stderr, "Error: Unable to run on CPUs %s: %s\n", cpus ? cpus : "", strerror (errno));
+		return false;
+	}
+	placement.numa     = numa;
+	placement.numnodes = numa ? placement_read_nodes () : 0;
+	if (numa && !placement.numnodes) {
+		printf ("Note: No NUMA nodes found, placing the jobs as if there was one.\n");
+	}
+	if (!placement.numnodes) {
+		placement.numnodes   = 1;
+		placement.nodes[0]   = placement.cpus;
+		placement.nodeids[0] = -1;
+	}
+	placement.nextslot = 0;
+	placement.enabled  = true;
+	char list[1024];
+	format_cpulist (&placement.cpus, list, sizeof (list));
+	printf ("Note: Running on CPUs %s", list);
+	for (unsigned int i = 0; numa && placement.nodeids[0] >= 0 && i < placement.numnodes; i++) {
+		format_cpulist (&placement.nodes[i], list, sizeof (list));
+		printf ("%s node %d: %s", i ? "," : ", on", placement.nodeids[i], list);
+	}
+	printf (".\n");
+	return true;
+}
+
+/* Pin the thread that runs a job to a CPU, when it runs its first job.  The
+ * threads take turns over the nodes, and over the CPUs within a node. */
+static void
+placement_pin_job (void)
+{
+	if (!placement.enabled || placement_cpu >= 0) {
+		return;
+	}
+	unsigned int     slot  = __atomic_fetch_add (&placement.nextslot, 1, __ATOMIC_RELAXED);
+	unsigned int     n     = slot % placement.numnodes;
+	const cpu_set_t* node  = &placement.nodes[n];
+	int              index = (slot / placement.numnodes) % CPU_COUNT (node);
+	int              cpu   = 0;
+	for (; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET (cpu, node) && !index--) {
+			break;
+		}
+	}
+	cpu_set_t set;
+	CPU_ZERO (&set);
+	CPU_SET (cpu, &set);
+	if (pthread_setaffinity_np (pthread_self (), sizeof (set), &set)) {
+		fprintf (stderr, "Error: Unable to pin the job to CPU %d\n", cpu);
+		return;
+	}
+	placement_cpu     = cpu;
+	placement_node    = placement.nodeids[n];
+	placement_helpers = *node;
+}
+
+/* Let a thread started by a job run on the CPUs of the job's node */
+static void
+placement_pin_helper (pthread_t thread)
+{
+	if (placement_cpu >= 0) {
+		pthread_setaffinity_np (thread, sizeof (cpu_set_t), &placement_helpers);
+	}
+}
+
+/* Print where the job on this thread runs */
+static void
+placement_report (void)
+{
+	if (placement_cpu < 0) {
+		return;
+	}
+	char helpers[1024];
+	format_cpulist (&placement_helpers, helpers, sizeof (helpers));
+	if (placement_node >= 0) {
+		printf ("Stats: placement: processing on CPU %d of node %d, readers and writers on CPUs %s.\n", placement_cpu, placement_node, helpers);
+	} else {
+		printf ("Stats: placement: processing on CPU %d, readers and writers on CPUs %s.\n", placement_cpu, helpers);
+	}
+}
+
+/* ****************************************************************************
+ * Input streams
+ *
+ * Every input file is decoded by its own thread, ahead of the processing
+ * loop.  The channels of all inputs are concatenated into one interleaved
+ * buffer: the main inputs first, followed by the sidechain inputs.
+ */
+
+#define READAHEAD_BLOCKS 2
+#define PRESCAN_SAMPLES 65536 // read at once by --pre-normalize
+#define MAX_INPUTS 16
+#define FOLLOW_POLL_MS 100
+
+static double
+elapsed_ms (const struct timespec* since)
+{
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1e3 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+struct inputstream {
+	SNDFILE*     file;
+	unsigned int numchannels;
+	unsigned int offset;    // first channel in the combined buffer
+	bool         sidechain; // does not determine the length of the job
+	bool         eof;
+	bool         limited; // --preview: read only limit more frames
+	sf_count_t   limit;
+
+	/* --follow: the file is still being written */
+	const char* path;
+	bool        follow, finished;
+	double      idletimeout; // seconds
+	sf_count_t  position;    // frames read
+	int         notify;      // inotify descriptor, or -1 to poll
+
+	unsigned int blocksize;
+	float*       blocks[READAHEAD_BLOCKS];
+	sf_count_t   numread[READAHEAD_BLOCKS];
+	unsigned int head, tail, count; // ring of decoded blocks
+	bool         stop;
+
+	pthread_t       thread;
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+};
+
+static bool
+inputstream_stopping (struct inputstream* s)
+{
+	pthread_mutex_lock (&s->lock);
+	bool stop = s->stop;
+	pthread_mutex_unlock (&s->lock);
+	return stop;
+}
+
+/* In --follow mode a short read means the file is still being written.  The
+ * stream waits for it to change, reopens it to pick up the new length and
+ * carries on, so that only full blocks are passed on, until INPUT.done
+ * exists and everything was read, or the file did not grow for the idle
+ * timeout. */
+static sf_count_t
+inputstream_read (struct inputstream* s, float* block)
+{
+	sf_count_t want = s->limited && s->limit < s->blocksize ? s->limit : s->blocksize;
+	sf_count_t got  = want ? sf_readf_float (s->file, block, want) : 0;
+	if (s->limited) {
+		s->limit -= got;
+	}
+	if (!s->follow) {
+		return got;
+	}
+	char sentinel[strlen (s->path) + 6];
+	sprintf (sentinel, "%s.done", s->path);
+	struct timespec lastgrowth;
+	clock_gettime (CLOCK_MONOTONIC, &lastgrowth);
+	while (got < s->blocksize && !s->finished) {
+		struct stat st;
+		bool        done = !stat (sentinel, &st);
+		if (!done) {
+			struct pollfd pfd = { s->notify, POLLIN, 0 };
+			if (poll (&pfd, s->notify >= 0, FOLLOW_POLL_MS) > 0) {
+				char events[4096];
+				while (read (s->notify, events, sizeof (events)) > 0) {
+				}
+			}
+			if (inputstream_stopping (s)) {
+				break;
+			}
+		}
+		SF_INFO  info   = { 0 };
+		SNDFILE* reopen = sf_open (s->path, SFM_READ, &info);
+		if (reopen) {
+			sf_close (s->file);
+			s->file = reopen;
+		}
+		sf_count_t n = 0;
+		if (sf_seek (s->file, s->position + got, SEEK_SET) >= 0) {
+			n = sf_readf_float (s->file, block + got * s->numchannels, s->blocksize - got);
+		}
+		if (n > 0) {
+			got += n;
+			clock_gettime (CLOCK_MONOTONIC, &lastgrowth);
+		} else if (done || elapsed_ms (&lastgrowth) > s->idletimeout * 1000) {
+			printf ("Note: Stopped following %s after %lld frames%s.\n", s->path, (long long)(s->position + got), done ? "" : ", it stopped growing");
+			s->finished = true;
+		}
+	}
+	s->position += got;
+	return got;
+}
+
+static void*
+inputstream_run (void* arg)
+{
+	struct inputstream* s = (struct inputstream*)arg;
+	pthread_mutex_lock (&s->lock);
+	while (!s->stop) {
+		while (s->count == READAHEAD_BLOCKS && !s->stop) {
+			pthread_cond_wait (&s->cond, &s->lock);
+		}
+		if (s->stop) {
+			break;
+		}
+		unsigned int slot = s->head;
+		pthread_mutex_unlock (&s->lock);
+		sf_count_t n = inputstream_read (s, s->blocks[slot]);
+		pthread_mutex_lock (&s->lock);
+		s->numread[slot] = n;
+		s->head          = (s->head + 1) % READAHEAD_BLOCKS;
+		s->count++;
+		pthread_cond_signal (&s->cond);
+		if (!n) {
+			break;
+		}
+	}
+	pthread_mutex_unlock (&s->lock);
+	return NULL;
+}
+
+static bool
+inputstream_start (struct inputstream* s, unsigned int blocksize)
+{
+	s->blocksize = blocksize;
+	s->head = s->tail = s->count = 0;
+	s->stop = s->eof = s->finished = false;
+	s->position      = 0;
+	s->notify        = -1;
+	if (s->follow && (s->notify = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC)) >= 0 && inotify_add_watch (s->notify, s->path, IN_MODIFY | IN_CLOSE_WRITE) < 0) {
+		close (s->notify);
+		s->notify = -1;
+	}
+	for (unsigned int i = 0; i < READAHEAD_BLOCKS; i++) {
+		s->blocks[i] = (float*)malloc (sizeof (float) * blocksize * s->numchannels);
+		if (!s->blocks[i]) {
+			while (i--) {
+				free (s->blocks[i]);
+			}
+			return false;
+		}
+	}
+	pthread_mutex_init (&s->lock, NULL);
+	pthread_cond_init (&s->cond, NULL);
+	if (pthread_create (&s->thread, NULL, inputstream_run, s)) {
+		pthread_mutex_destroy (&s->lock);
+		pthread_cond_destroy (&s->cond);
+		for (unsigned int i = 0; i < READAHEAD_BLOCKS; i++) {
+			free (s->blocks[i]);
+		}
+		if (s->notify >= 0) {
+			close (s->notify);
+		}
+		return false;
+	}
+	placement_pin_helper (s->thread);
+	return true;
+}
+
+static void
+inputstream_stop (struct inputstream* s)
+{
+	pthread_mutex_lock (&s->lock);
+	s->stop = true;
+	pthread_cond_signal (&s->cond);
+	pthread_mutex_unlock (&s->lock);
+	pthread_join (s->thread, NULL);
+	pthread_mutex_destroy (&s->lock);
+	pthread_cond_destroy (&s->cond);
+	if (s->notify >= 0) {
+		close (s->notify);
+	}
+	for (unsigned int i = 0; i < READAHEAD_BLOCKS; i++) {
+		free (s->blocks[i]);
+	}
+}
+
+/* Take the next decoded block of the stream and copy it into its channels
+ * of the combined buffer, padding with silence past the end of the file. */
+static sf_count_t
+inputstream_pop (struct inputstream* s, float* buffer, unsigned int numchannels)
+{
+	sf_count_t n = 0;
+	if (!s->eof) {
+		pthread_mutex_lock (&s->lock);
+		while (!s->count) {
+			pthread_cond_wait (&s->cond, &s->lock);
+		}
+		unsigned int slot = s->tail;
+		pthread_mutex_unlock (&s->lock);
+
+		n                  = s->numread[slot];
+		const float* block = s->blocks[slot];
+		for (sf_count_t i = 0; i < n; i++) {
+			for (unsigned int c = 0; c < s->numchannels; c++) {
+				buffer[i * numchannels + s->offset + c] = block[i * s->numchannels + c];
+			}
+		}
+
+		pthread_mutex_lock (&s->lock);
+		s->tail = (s->tail + 1) % READAHEAD_BLOCKS;
+		s->count--;
+		s->eof = !n;
+		pthread_cond_signal (&s->cond);
+		pthread_mutex_unlock (&s->lock);
+	}
+	for (sf_count_t i = n; i < s->blocksize; i++) {
+		for (unsigned int c = 0; c < s->numchannels; c++) {
+			buffer[i * numchannels + s->offset + c] = 0;
+		}
+	}
+	return n;
+}
+
+/* Read the next block of all inputs in lockstep.  Returns the number of
+ * frames left in the longest main input, the other inputs are padded with
+ * silence (and sidechains cut) to it. */
+static sf_count_t
+read_inputs (unsigned int numinputs, struct inputstream inputs[numinputs], float* buffer, unsigned int numchannels)
+{
+	sf_count_t numread = 0;
+	for (unsigned int i = 0; i < numinputs; i++) {
+		sf_count_t n = inputstream_pop (&inputs[i], buffer, numchannels);
+		if (!inputs[i].sidechain && n > numread) {
+			numread = n;
+		}
+	}
+	return numread;
+}
+
+/* Add the peak and the squares of a whole input to the totals of
+ * --pre-normalize, and rewind it.  Without squares the peak is taken from the
+ * PEAK chunk of the header, if there is one, and the file is not read. */
+static bool
+inputstream_scan (struct inputstream* s, bool squares, double* peak, double* sumsquares, sf_count_t* numsamples, bool* fromheader)
+{
+	double max;
+	if (!squares && sf_command (s->file, SFC_GET_SIGNAL_MAX, &max, sizeof (max)) == SF_TRUE) {
+		*peak = max > *peak ? max : *peak;
+		return true;
+	}
+	*fromheader = false;
+	if (sf_seek (s->file, 0, SEEK_SET) < 0) {
+		return false;
+	}
+	const sf_count_t chunk  = PRESCAN_SAMPLES / s->numchannels;
+	float*           buffer = (float*)malloc (sizeof (float) * chunk * s->numchannels);
+	if (!buffer) {
+		return false;
+	}
+	sf_count_t n;
+	while ((n = sf_readf_float (s->file, buffer, chunk)) > 0) {
+		const size_t size     = (size_t)n * s->numchannels;
+		float        lanes[8] = { 0, 0, 0, 0, 0, 0, 0, 0 }, sums[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+		size_t       i        = 0;
+		for (; i + 8 <= size; i += 8) {
+			for (unsigned int q = 0; q < 8; q++) {
+				float a  = fabsf (buffer[i + q]);
+				lanes[q] = a > lanes[q] ? a : lanes[q];
+				sums[q] += a * a;
+			}
+		}
+		for (; i < size; i++) {
+			float a  = fabsf (buffer[i]);
+			lanes[0] = a > lanes[0] ? a : lanes[0];
+			sums[0] += a * a;
+		}
+		for (unsigned int q = 0; q < 8; q++) {
+			*peak = lanes[q] > *peak ? lanes[q] : *peak;
+			*sumsquares += sums[q];
+		}
+		*numsamples += size;
+	}
+	free (buffer);
+	return n == 0 && sf_seek (s->file, 0, SEEK_SET) == 0;
+}
+
+/* ****************************************************************************
+ * Checksums
+ *
+ * Every output is hashed in blocks of CHECKSUM_FRAMES frames, independent of
+ * the processing blocksize, so renders with different settings can be
+ * compared block by block.  The hash is xxhash-style with eight independent
+ * lanes which vectorize; it covers the exact bits of the floats.
+ */
+
+#define CHECKSUM_FRAMES 4096
+
+#define PRIME32_1 2654435761U
+#define PRIME32_2 2246822519U
+#define PRIME32_3 3266489917U
+#define PRIME32_4 668265263U
+#define PRIME32_5 374761393U
+
+struct checksum {
+	bool       enabled, failed;
+	uint32_t*  block; // samples of the current block
+	sf_count_t fill;
+	uint32_t*  hashes; // one per completed block
+	size_t     numblocks, capacity;
+	sf_count_t capture; // block whose samples are kept, or -1
+	float*     captured;
+	sf_count_t numcaptured;
+};
+
+/* When rendering for --compare, the outputs are not written but hashed,
+ * and the results sent to the parent through fd */
+static struct {
+	int        fd;
+	sf_count_t capture;
+} compare_sink = { -1, -1 };
+
+static inline uint32_t
+rotl32 (uint32_t x, unsigned int r)
+{
+	return (x << r) | (x >> (32 - r));
+}
+
+static uint32_t
+checksum_hash (const uint32_t* words, size_t size, uint32_t seed)
+{
+	uint32_t lanes[8];
+	for (unsigned int q = 0; q < 8; q++) {
+		lanes[q] = seed + PRIME32_1 * (q + 1);
+	}
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		/* rotl32 () written out in steps, as gcc only vectorizes it that way */
+		uint32_t v[8];
+		for (unsigned int q = 0; q < 8; q++) {
+			v[q] = lanes[q] + words[i + q] * PRIME32_2;
+		}
+		for (unsigned int q = 0; q < 8; q++) {
+			v[q] = (v[q] << 13) | (v[q] >> 19);
+		}
+		for (unsigned int q = 0; q < 8; q++) {
+			lanes[q] = v[q] * PRIME32_1;
+		}
+	}
+	uint32_t h = (uint32_t)size * PRIME32_5;
+	for (unsigned int q = 0; q < 8; q++) {
+		h = rotl32 (h ^ lanes[q], 17) * PRIME32_4;
+	}
+	for (; i < size; i++) {
+		h = rotl32 (h + words[i] * PRIME32_3, 17) * PRIME32_4;
+	}
+	h ^= h >> 15;
+	h *= PRIME32_2;
+	h ^= h >> 13;
+	h *= PRIME32_3;
+	h ^= h >> 16;
+	return h;
+}
+
+static bool
+checksum_init (struct checksum* c, unsigned int numchannels, sf_count_t capture)
+{
+	memset (c, 0, sizeof (struct checksum));
+	c->enabled = true;
+	c->capture = capture;
+	c->block   = (uint32_t*)malloc (sizeof (uint32_t) * CHECKSUM_FRAMES * numchannels);
+	return c->block != NULL;
+}
+
+static void
+checksum_free (struct checksum* c)
+{
+	free (c->block);
+	free (c->hashes);
+	free (c->captured);
+}
+
+static void
+checksum_flush (struct checksum* c)
+{
+	if (c->numblocks == c->capacity) {
+		size_t    capacity = c->capacity ? 2 * c->capacity : 256;
+		uint32_t* hashes   = (uint32_t*)realloc (c->hashes, sizeof (uint32_t) * capacity);
+		if (!hashes) {
+			c->failed = true;
+			return;
+		}
+		c->hashes   = hashes;
+		c->capacity = capacity;
+	}
+	if ((sf_count_t)c->numblocks == c->capture && (c->captured = (float*)malloc (sizeof (float) * c->fill))) {
+		memcpy (c->captured, c->block, sizeof (float) * c->fill);
+		c->numcaptured = c->fill;
+	}
+	c->hashes[c->numblocks++] = checksum_hash (c->block, c->fill, 0);
+	c->fill                   = 0;
+}
+
+static void
+checksum_update (struct checksum* c, unsigned int numchannels, const float* samples, sf_count_t numframes)
+{
+	const sf_count_t blocksize = (sf_count_t)CHECKSUM_FRAMES * numchannels;
+	sf_count_t       size      = numframes * numchannels;
+	while (size && !c->failed) {
+		sf_count_t n = blocksize - c->fill < size ? blocksize - c->fill : size;
+		memcpy (c->block + c->fill, samples, sizeof (float) * n);
+		c->fill += n;
+		samples += n;
+		size -= n;
+		if (c->fill == blocksize) {
+			checksum_flush (c);
+		}
+	}
+}
+
+/* Hash of the whole output, from the hashes of its blocks */
+static uint32_t
+checksum_finish (struct checksum* c, unsigned int numchannels)
+{
+	if (c->fill && !c->failed) {
+		checksum_flush (c);
+	}
+	return checksum_hash (c->hashes, c->numblocks, numchannels);
+}
+
+static bool
+write_all (int fd, const void* data, size_t size)
+{
+	for (const char* p = (const char*)data; size;) {
+		ssize_t n = write (fd, p, size);
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+static bool
+read_all (int fd, void* data, size_t size)
+{
+	for (char* p = (char*)data; size;) {
+		ssize_t n = read (fd, p, size);
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+struct render {
+	unsigned int numoutputs;
+	struct {
+		unsigned int numchannels;
+		size_t       numblocks;
+		uint32_t*    hashes;
+		sf_count_t   numcaptured;
+		float*       captured;
+	} outputs[];
+};
+
+static void
+render_free (struct render* r)
+{
+	for (unsigned int i = 0; r && i < r->numoutputs; i++) {
+		free (r->outputs[i].hashes);
+		free (r->outputs[i].captured);
+	}
+	free (r);
+}
+
+static struct render*
+render_receive (int fd)
+{
+	uint64_t count;
+	if (!read_all (fd, &count, sizeof (count)) || count > 100000) {
+		return NULL;
+	}
+	struct render* r = (struct render*)calloc (1, sizeof (struct render) + count * sizeof (r->outputs[0]));
+	if (!r) {
+		return NULL;
+	}
+	for (; r->numoutputs < count; r->numoutputs++) {
+		uint64_t header[3];
+		if (!read_all (fd, header, sizeof (header))) {
+			break;
+		}
+		r->outputs[r->numoutputs].numchannels = header[0];
+		r->outputs[r->numoutputs].numblocks   = header[1];
+		r->outputs[r->numoutputs].numcaptured = header[2];
+		r->outputs[r->numoutputs].hashes      = (uint32_t*)malloc (sizeof (uint32_t) * header[1] + 1);
+		r->outputs[r->numoutputs].captured    = (float*)malloc (sizeof (float) * header[2] + 1);
+		if (!r->outputs[r->numoutputs].hashes || !r->outputs[r->numoutputs].captured || !read_all (fd, r->outputs[r->numoutputs].hashes, sizeof (uint32_t) * header[1]) || !read_all (fd, r->outputs[r->numoutputs].captured, sizeof (float) * header[2])) {
+			r->numoutputs++;
+			break;
+		}
+	}
+	if (r->numoutputs < count) {
+		render_free (r);
+		return NULL;
+	}
+	return r;
+}
+
+int main (int argc, char** argv);
+
+/* Run the command line without its --compare options, plus the given extra
+ * options, in a child process that only hashes its outputs */
+static struct render*
+render_run (int argc, char** argv, const char* extra, sf_count_t capture)
+{
+	char*  options = strdup (extra ? extra : "");
+	char*  args[argc + strlen (options) / 2 + 2];
+	int    numargs = 0;
+	for (int i = 0; i < argc; i++) {
+		if (!strcmp (argv[i], "--compare")) {
+			i++;
+		} else if (strncmp (argv[i], "--compare=", 10)) {
+			args[numargs++] = argv[i];
+		}
+	}
+	for (char* token = strtok (options, " \t"); token; token = strtok (NULL, " \t")) {
+		args[numargs++] = token;
+	}
+	args[numargs] = NULL;
+
+	struct render* r = NULL;
+	int            fds[2];
+	if (pipe (fds)) {
+		perror ("pipe");
+		free (options);
+		return NULL;
+	}
+	fflush (stdout);
+	pid_t pid = fork ();
+	if (pid == 0) {
+		close (fds[0]);
+		compare_sink.fd      = fds[1];
+		compare_sink.capture = capture;
+		main (numargs, args);
+		close (fds[1]);
+		exit (0);
+	}
+	close (fds[1]);
+	if (pid > 0) {
+		r = render_receive (fds[0]);
+		waitpid (pid, NULL, 0);
+	} else {
+		perror ("fork");
+	}
+	close (fds[0]);
+	free (options);
+	return r;
+}
+
+/* First block in which any output of the two renders differs, or -1 */
+static sf_count_t
+render_first_difference (const struct render* a, const struct render* b, size_t* numdiffering)
+{
+	sf_count_t first = -1;
+	*numdiffering    = 0;
+	for (unsigned int i = 0; i < a->numoutputs; i++) {
+		size_t numblocks = a->outputs[i].numblocks > b->outputs[i].numblocks ? a->outputs[i].numblocks : b->outputs[i].numblocks;
+		for (size_t block = 0; block < numblocks; block++) {
+			if (block >= a->outputs[i].numblocks || block >= b->outputs[i].numblocks || a->outputs[i].hashes[block] != b->outputs[i].hashes[block]) {
+				if (first < 0 || (sf_count_t)block < first) {
+					first = block;
+				}
+				(*numdiffering)++;
+			}
+		}
+	}
+	return first;
+}
+
+/* Render twice with different options and report where the outputs differ */
+static void
+compare_renders (int argc, char** argv, int numoptions, const char** options)
+{
+	const char*    first  = numoptions > 1 ? options[0] : NULL;
+	const char*    second = options[numoptions - 1];
+	struct render *a = NULL, *b = NULL, *ca = NULL, *cb = NULL;
+	if (!(a = render_run (argc, argv, first, -1)) || !(b = render_run (argc, argv, second, -1))) {
+		fprintf (stderr, "Error: Rendering for the comparison failed\n");
+		goto cleanup;
+	}
+	bool samelayout = a->numoutputs == b->numoutputs;
+	for (unsigned int i = 0; samelayout && i < a->numoutputs; i++) {
+		samelayout = a->outputs[i].numchannels == b->outputs[i].numchannels;
+	}
+	if (!samelayout) {
+		fprintf (stderr, "Error: The two renders have different outputs, they cannot be compared\n");
+		goto cleanup;
+	}
+	size_t     numdiffering;
+	sf_count_t block = render_first_difference (a, b, &numdiffering);
+	if (block < 0) {
+		for (unsigned int i = 0; i < a->numoutputs; i++) {
+			printf ("Compare: Output %u is identical, %zu blocks of %d frames, checksum %08x.\n", i + 1, a->outputs[i].numblocks, CHECKSUM_FRAMES, checksum_hash (a->outputs[i].hashes, a->outputs[i].numblocks, a->outputs[i].numchannels));
+		}
+		goto cleanup;
+	}
+	printf ("Compare: %zu blocks of %d frames differ, the first one is block %lld (frames %lld to %lld).\n", numdiffering, CHECKSUM_FRAMES, (long long)block, (long long)block * CHECKSUM_FRAMES, (long long)(block + 1) * CHECKSUM_FRAMES - 1);
+
+	/* render again, keeping the samples of that block */
+	if (!(ca = render_run (argc, argv, first, block)) || !(cb = render_run (argc, argv, second, block))) {
+		fprintf (stderr, "Error: Rendering for the comparison failed\n");
+		goto cleanup;
+	}
+	for (unsigned int i = 0; i < ca->numoutputs && i < cb->numoutputs; i++) {
+		const unsigned int numchannels = ca->outputs[i].numchannels;
+		const sf_count_t   na = ca->outputs[i].numcaptured, nb = cb->outputs[i].numcaptured;
+		double             maxerror = 0;
+		sf_count_t         at       = -1;
+		for (sf_count_t s = 0; s < na && s < nb; s++) {
+			double error = fabs ((double)ca->outputs[i].captured[s] - cb->outputs[i].captured[s]);
+			if (error > maxerror || (at < 0 && error != 0) || error != error) {
+				maxerror = error;
+				at       = s;
+			}
+		}
+		if (na != nb) {
+			printf ("Compare: Output %u ends at different lengths: %lld and %lld frames into block %lld.\n", i + 1, (long long)(na / numchannels), (long long)(nb / numchannels), (long long)block);
+		}
+		if (at >= 0) {
+			printf ("Compare: Output %u differs by up to %g (%.1f dBFS) at frame %lld, channel %u.\n", i + 1, maxerror, 20 * log10 (maxerror), (long long)(block * CHECKSUM_FRAMES + at / numchannels), (unsigned int)(at % numchannels) + 1);
+		}
+	}
+
+cleanup:
+	render_free (a);
+	render_free (b);
+	render_free (ca);
+	render_free (cb);
+}
+
+/* ****************************************************************************
+ * Dry run
+ *
+ * --dry-run sets a job up exactly like a render, then processes only the
+ * first DRYRUN_CALIBRATION seconds of the input, without writing anything,
+ * and scales the time that took to the length of the input.  The jobs of
+ * --batch add up to a total.
+ */
+
+#define DRYRUN_CALIBRATION 2.0 // seconds
+
+static struct {
+	bool         enabled;
+	unsigned int numjobs;
+	double       wall, cpu; // seconds
+	size_t       memory;    // of the largest job
+	double       bytes;
+	bool         compressed; // bytes is an upper bound
+} dryrun = { false, 0, 0, 0, 0, 0, false };
+
+static double
+cpu_seconds (void)
+{
+	struct timespec t;
+	clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Bytes per sample of the format, 0 if it is not a fixed size */
+static unsigned int
+sample_bytes (int format)
+{
+	switch (format & SF_FORMAT_SUBMASK) {
+	case SF_FORMAT_PCM_S8:
+	case SF_FORMAT_PCM_U8:
+	case SF_FORMAT_ULAW:
+	case SF_FORMAT_ALAW:
+		return 1;
+	case SF_FORMAT_PCM_16:
+		return 2;
+	case SF_FORMAT_PCM_24:
+		return 3;
+	case SF_FORMAT_PCM_32:
+	case SF_FORMAT_FLOAT:
+		return 4;
+	case SF_FORMAT_DOUBLE:
+		return 8;
+	default:
+		return 0;
+	}
+}
+
+static void
+dryrun_total (void)
+{
+	printf ("Estimate: %u jobs, %.1f s wall time, %.1f s CPU time, %.1f MB memory, %s%.1f MB output.\n", dryrun.numjobs, dryrun.wall, dryrun.cpu, dryrun.memory / 1048576.0, dryrun.compressed ? "at most " : "", dryrun.bytes / 1048576);
+}
+
+/* ****************************************************************************
+ * Progress
+ *
+ * --progress maps a small status file, ideally in /dev/shm, which the
+ * processing loop updates once per block with relaxed atomic stores.  Other
+ * programs can map it read-only and poll any number of jobs without system
+ * calls.  The layout is fixed, in native byte order; magic is written last,
+ * so a reader seeing it sees the rest of the header.
+ */
+
+#define PROGRESS_MAGIC 0x5032564cU // "LV2P" in little endian
+#define PROGRESS_VERSION 1
+#define PROGRESS_WINDOW_MS 500 // the realtime factor is measured over this
+
+enum { STAGE_STARTING, STAGE_PROCESSING, STAGE_FINISHING, STAGE_DONE, STAGE_FAILED };
+
+struct progressstatus {
+	uint32_t magic, version;
+	int32_t  pid;
+	uint32_t stage;
+	int64_t  frames;   // input frames processed
+	int64_t  total;    // input frames, -1 if unknown
+	int64_t  clips;    // clipped output samples
+	double   realtime; // seconds of audio per second, lately
+	int64_t  updated;  // CLOCK_REALTIME in ns, at least every PROGRESS_WINDOW_MS while processing
+};
+
+struct progress {
+	struct progressstatus* status;
+	double                 rate; // of the input
+	struct timespec        window;
+	sf_count_t             windowframes;
+	sf_count_t             frames, clips; // also kept without a status file
+};
+
+static int64_t
+realtime_ns (void)
+{
+	struct timespec t;
+	clock_gettime (CLOCK_REALTIME, &t);
+	return t.tv_sec * (int64_t)1000000000 + t.tv_nsec;
+}
+
+static bool
+progress_open (struct progress* p, const char* path)
+{
+	int fd = open (path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0 || ftruncate (fd, sizeof (struct progressstatus))) {
+		fprintf (stderr, "Error creating the progress file %s: %s\n", path, strerror (errno));
+		if (fd >= 0) {
+			close (fd);
+		}
+		return false;
+	}
+	p->status = (struct progressstatus*)mmap (NULL, sizeof (struct progressstatus), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+	if (p->status == MAP_FAILED) {
+		fprintf (stderr, "Error mapping the progress file %s: %s\n", path, strerror (errno));
+		p->status = NULL;
+		return false;
+	}
+	p->status->version = PROGRESS_VERSION;
+	p->status->pid     = getpid ();
+	p->status->stage   = STAGE_STARTING;
+	p->status->total   = -1;
+	p->status->updated = realtime_ns ();
+	__atomic_store_n (&p->status->magic, PROGRESS_MAGIC, __ATOMIC_RELEASE);
+	return true;
+}
+
+static void
+progress_stage (struct progress* p, uint32_t stage)
+{
+	if (p->status) {
+		__atomic_store_n (&p->status->stage, stage, __ATOMIC_RELAXED);
+		__atomic_store_n (&p->status->updated, realtime_ns (), __ATOMIC_RELAXED);
+	}
+}
+
+static void
+progress_start (struct progress* p, sf_count_t total, double rate)
+{
+	if (p->status) {
+		p->rate         = rate;
+		p->windowframes = 0;
+		clock_gettime (CLOCK_MONOTONIC, &p->window);
+		__atomic_store_n (&p->status->total, total, __ATOMIC_RELAXED);
+		progress_stage (p, STAGE_PROCESSING);
+	}
+}
+
+/* Once per block, from the processing loop */
+static inline void
+progress_update (struct progress* p, sf_count_t frames, sf_count_t clips)
+{
+	p->frames = frames;
+	p->clips  = clips;
+	if (!p->status) {
+		return;
+	}
+	__atomic_store_n (&p->status->frames, frames, __ATOMIC_RELAXED);
+	__atomic_store_n (&p->status->clips, clips, __ATOMIC_RELAXED);
+	double ms = elapsed_ms (&p->window); // vDSO, no system call
+	if (ms >= PROGRESS_WINDOW_MS) {
+		double realtime = (frames - p->windowframes) / p->rate / (ms / 1000);
+		__atomic_store (&p->status->realtime, &realtime, __ATOMIC_RELAXED);
+		__atomic_store_n (&p->status->updated, realtime_ns (), __ATOMIC_RELAXED);
+		p->windowframes = frames;
+		clock_gettime (CLOCK_MONOTONIC, &p->window);
+	}
+}
+
+/* The file stays for the supervisor, with the final stage */
+static void
+progress_close (struct progress* p)
+{
+	if (p->status) {
+		if (p->status->stage != STAGE_DONE) {
+			progress_stage (p, STAGE_FAILED);
+		}
+		munmap (p->status, sizeof (struct progressstatus));
+		p->status = NULL;
+	}
+}
+
+/* ****************************************************************************
+ * Metrics
+ *
+ * --metrics-file keeps cumulative counters of all jobs in the Prometheus text
+ * format, for the textfile collector of node_exporter.  The jobs add to the
+ * counters with relaxed atomics; a thread writes them every few seconds to
+ * a temporary file, which is renamed over the metrics file so the collector
+ * never reads half of it.
+ */
+
+enum { METRIC_SETUP, METRIC_PROCESSING, METRIC_FINISHING, NUM_METRIC_STAGES };
+
+static const char* const metric_stages[NUM_METRIC_STAGES] = { "setup", "processing", "finishing" };
+
+static struct {
+	uint64_t jobs_completed, jobs_failed, jobs_running;
+	uint64_t frames, clipped;
+	uint64_t stage_ns[NUM_METRIC_STAGES];
+	uint64_t pool_hits, pool_misses;
+	uint64_t queue_depth;
+} metrics;
+
+struct metricswriter {
+	const char* path;
+	double      interval; // seconds
+	bool        stop;
+
+	pthread_t       thread;
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+};
+
+static void
+metrics_add (uint64_t* counter, uint64_t value)
+{
+	__atomic_fetch_add (counter, value, __ATOMIC_RELAXED);
+}
+
+static uint64_t
+metrics_get (const uint64_t* counter)
+{
+	return __atomic_load_n (counter, __ATOMIC_RELAXED);
+}
+
+/* Add the time since *since to a stage, and start timing the next one */
+static void
+metrics_stage (struct timespec* since, int stage)
+{
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	metrics_add (&metrics.stage_ns[stage], (now.tv_sec - since->tv_sec) * (uint64_t)1000000000 + now.tv_nsec - since->tv_nsec);
+	*since = now;
+}
+
+static void
+metrics_write (const char* path)
+{
+	char temp[strlen (path) + 16];
+	snprintf (temp, sizeof (temp), "%s.%d", path, (int)getpid ());
+	FILE* out = fopen (temp, "w");
+	if (!out) {
+		fprintf (stderr, "Error writing the metrics to %s: %s\n", temp, strerror (errno));
+		return;
+	}
+	fprintf (out, "# HELP lv2file_jobs_total Jobs that ended, by result.\n# TYPE lv2file_jobs_total counter\n");
+	fprintf (out, "lv2file_jobs_total{result=\"completed\"} %llu\n", (unsigned long long)metrics_get (&metrics.jobs_completed));
+	fprintf (out, "lv2file_jobs_total{result=\"failed\"} %llu\n", (unsigned long long)metrics_get (&metrics.jobs_failed));
+	fprintf (out, "# HELP lv2file_jobs_running Jobs running now.\n# TYPE lv2file_jobs_running gauge\n");
+	fprintf (out, "lv2file_jobs_running %llu\n", (unsigned long long)metrics_get (&metrics.jobs_running));
+	fprintf (out, "# HELP lv2file_frames_processed_total Input frames processed.\n# TYPE lv2file_frames_processed_total counter\n");
+	fprintf (out, "lv2file_frames_processed_total %llu\n", (unsigned long long)metrics_get (&metrics.frames));
+	fprintf (out, "# HELP lv2file_clipped_samples_total Output samples that were clipped.\n# TYPE lv2file_clipped_samples_total counter\n");
+	fprintf (out, "lv2file_clipped_samples_total %llu\n", (unsigned long long)metrics_get (&metrics.clipped));
+	fprintf (out, "# HELP lv2file_stage_seconds_total Time the jobs spent in each stage.\n# TYPE lv2file_stage_seconds_total counter\n");
+	for (int stage = 0; stage < NUM_METRIC_STAGES; stage++) {
+		fprintf (out, "lv2file_stage_seconds_total{stage=\"%s\"} %.6f\n", metric_stages[stage], metrics_get (&metrics.stage_ns[stage]) / 1e9);
+	}
+	fprintf (out, "# HELP lv2file_pool_requests_total Plugin instances requested from the pool, by whether one could be reused.\n# TYPE lv2file_pool_requests_total counter\n");
+	fprintf (out, "lv2file_pool_requests_total{result=\"hit\"} %llu\n", (unsigned long long)metrics_get (&metrics.pool_hits));
+	fprintf (out, "lv2file_pool_requests_total{result=\"miss\"} %llu\n", (unsigned long long)metrics_get (&metrics.pool_misses));
+	fprintf (out, "# HELP lv2file_queue_depth Files waiting for a --watch worker.\n# TYPE lv2file_queue_depth gauge\n");
+	fprintf (out, "lv2file_queue_depth %llu\n", (unsigned long long)metrics_get (&metrics.queue_depth));
+	if (fclose (out) || rename (temp, path)) {
+		fprintf (stderr, "Error writing the metrics to %s: %s\n", path, strerror (errno));
+		unlink (temp);
+	}
+}
+
+static void*
+metrics_run (void* arg)
+{
+	struct metricswriter* w = (struct metricswriter*)arg;
+	pthread_mutex_lock (&w->lock);
+	while (!w->stop) {
+		struct timespec until;
+		clock_gettime (CLOCK_REALTIME, &until);
+		double seconds = until.tv_nsec / 1e9 + w->interval;
+		until.tv_sec += (time_t)seconds;
+		until.tv_nsec = (seconds - (time_t)seconds) * 1e9;
+		while (!w->stop && pthread_cond_timedwait (&w->cond, &w->lock, &until) != ETIMEDOUT) {
+		}
+		pthread_mutex_unlock (&w->lock);
+		metrics_write (w->path);
+		pthread_mutex_lock (&w->lock);
+	}
+	pthread_mutex_unlock (&w->lock);
+	return NULL;
+}
+
+static bool
+metrics_start (struct metricswriter* w, const char* path, double interval)
+{
+	w->path     = path;
+	w->interval = interval > 0.1 ? interval : 0.1;
+	w->stop     = false;
+	pthread_mutex_init (&w->lock, NULL);
+	pthread_cond_init (&w->cond, NULL);
+	if (pthread_create (&w->thread, NULL, metrics_run, w)) {
+		pthread_mutex_destroy (&w->lock);
+		pthread_cond_destroy (&w->cond);
+		return false;
+	}
+	return true;
+}
+
+/* Stop the writer, which writes the final values */
+static void
+metrics_stop (struct metricswriter* w)
+{
+	pthread_mutex_lock (&w->lock);
+	w->stop = true;
+	pthread_cond_signal (&w->cond);
+	pthread_mutex_unlock (&w->lock);
+	pthread_join (w->thread, NULL);
+	pthread_mutex_destroy (&w->lock);
+	pthread_cond_destroy (&w->cond);
+}
+
+/* ****************************************************************************
+ * Output streams
+ *
+ * Every output file is written by its own encoder thread.  The processing
+ * loop interleaves the plugin outputs a file is made of straight into one of
+ * the stream's blocks and hands it over; the writer drains it while the next
+ * block is being processed.
+ */
+
+#define WRITEBEHIND_BLOCKS 2
+
+/* One excerpt of --preview, see run_preview () */
+struct excerptoutput {
+	char*      path;
+	SF_INFO    info;
+	float*     samples;
+	sf_count_t numframes;
+};
+
+struct excerpt {
+	unsigned int number;                 // from 1
+	sf_count_t   start, length, preroll; // input frames
+	bool         join;                   // keep the outputs in memory instead of writing them
+
+	unsigned int          numoutputs;
+	struct excerptoutput* outputs;
+};
+
+/* the excerpt the job on this thread renders, if any */
+static __thread struct excerpt* current_excerpt = NULL;
+
+struct outputstream {
+	char*         path;
+	SNDFILE*      file;
+	SF_INFO       info;
+	unsigned int  numchannels;
+	unsigned int  numsources;
+	const float** sources; // plugin output buffer of every channel, or source of the matrix
+	const float*  matrix;  // --output-matrix, numchannels x numsources
+	bool          failed;
+	bool          sync; // --follow: flush to disk regularly
+
+	/* --preview: collected for joining the excerpts */
+	bool       inmemory;
+	float*     memory;
+	sf_count_t memframes, memcapacity;
+
+	struct checksum     checksum;
+	struct outputstats* stats;    // --stats
+	struct limiter*     limiter;  // --limiter
+	float               softclip; // ceiling of --soft-clip, 0 if off
+
+	unsigned int blocksize;
+	float*       blocks[WRITEBEHIND_BLOCKS];
+	sf_count_t   numframes[WRITEBEHIND_BLOCKS];
+	unsigned int head, tail, count; // ring of blocks waiting to be written
+	bool         stop;
+
+	pthread_t       thread;
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+};
+
+/* Substitute {instance}, {port} and {excerpt} in an output file name */
+static char*
+expand_output_template (const char* template, unsigned int instance, const char* port, unsigned int excerpt)
+{
+	char   number[16], excerptnumber[16];
+	size_t len = strlen (template) + 1;
+	snprintf (number, sizeof (number), "%u", instance);
+	snprintf (excerptnumber, sizeof (excerptnumber), "%u", excerpt);
+	for (const char* c = template; (c = strchr (c, '{')); c++) {
+		len += strlen (number) + strlen (excerptnumber) + (port ? strlen (port) : 0);
+	}
+	char* path = (char*)malloc (len);
+	char* out  = path;
+	while (*template) {
+		if (!strncmp (template, "{instance}", 10)) {
+			out += sprintf (out, "%s", number);
+			template += 10;
+		} else if (port && !strncmp (template, "{port}", 6)) {
+			out += sprintf (out, "%s", port);
+			template += 6;
+		} else if (excerpt && !strncmp (template, "{excerpt}", 9)) {
+			out += sprintf (out, "%s", excerptnumber);
+			template += 9;
+		} else {
+			*out++ = *template++;
+		}
+	}
+	*out = 0;
+	return path;
+}
+
+static bool
+outputstream_open (struct outputstream* s, char* path, SF_INFO formatinfo, unsigned int numchannels, unsigned int numsources)
+{
+	s->path             = path;
+	s->numchannels      = numchannels;
+	s->numsources       = numsources;
+	s->failed           = false;
+	s->sources          = (const float**)calloc (numsources, sizeof (float*));
+	s->sync             = false;
+	s->inmemory         = current_excerpt && current_excerpt->join;
+	formatinfo.channels = numchannels;
+	s->info             = formatinfo;
+	if (compare_sink.fd >= 0 || s->inmemory || dryrun.enabled) {
+		s->file = NULL;
+		return true;
+	}
+	s->file = sf_open (path, SFM_WRITE, &formatinfo);
+	int sndfileerr      = sf_error (s->file);
+	if (sndfileerr) {
+		fprintf (stderr, "Error opening output file %s: %s\n", path, sf_error_number (sndfileerr));
+		return false;
+	}
+	return true;
+}
+
+static void
+outputstream_close (struct outputstream* s)
+{
+	if (s->file && sf_close (s->file)) {
+		fprintf (stderr, "Error closing output file %s!\n", s->path);
+	}
+	checksum_free (&s->checksum);
+	free (s->memory);
+	free (s->sources);
+	free (s->path);
+}
+
+static void*
+outputstream_run (void* arg)
+{
+	struct outputstream* s = (struct outputstream*)arg;
+	struct timespec      lastsync;
+	clock_gettime (CLOCK_MONOTONIC, &lastsync);
+	pthread_mutex_lock (&s->lock);
+	for (;;) {
+		while (!s->count && !s->stop) {
+			pthread_cond_wait (&s->cond, &s->lock);
+		}
+		if (!s->count) {
+			break;
+		}
+		unsigned int slot = s->tail;
+		pthread_mutex_unlock (&s->lock);
+		if (s->file && sf_writef_float (s->file, s->blocks[slot], s->numframes[slot]) != s->numframes[slot] && !s->failed) {
+			fprintf (stderr, "Error writing output file %s: %s\n", s->path, sf_strerror (s->file));
+			s->failed = true;
+		}
+		if (s->checksum.enabled) {
+			checksum_update (&s->checksum, s->numchannels, s->blocks[slot], s->numframes[slot]);
+		}
+		if (s->inmemory && !s->failed) {
+			if (s->memframes + s->numframes[slot] > s->memcapacity) {
+				sf_count_t capacity = s->memcapacity ? 2 * s->memcapacity : 4 * s->blocksize;
+				while (capacity < s->memframes + s->numframes[slot]) {
+					capacity *= 2;
+				}
+				float* memory = (float*)realloc (s->memory, sizeof (float) * capacity * s->numchannels);
+				if (!memory) {
+					fprintf (stderr, "Error: insufficient memory for %s\n", s->path);
+					s->failed = true;
+				} else {
+					s->memory      = memory;
+					s->memcapacity = capacity;
+				}
+			}
+			if (!s->failed) {
+				memcpy (s->memory + s->memframes * s->numchannels, s->blocks[slot], sizeof (float) * s->numframes[slot] * s->numchannels);
+				s->memframes += s->numframes[slot];
+			}
+		}
+		if (s->sync && s->file && elapsed_ms (&lastsync) > 1000) {
+			sf_write_sync (s->file);
+			clock_gettime (CLOCK_MONOTONIC, &lastsync);
+		}
+		pthread_mutex_lock (&s->lock);
+		s->tail = (s->tail + 1) % WRITEBEHIND_BLOCKS;
+		s->count--;
+		pthread_cond_signal (&s->cond);
+	}
+	pthread_mutex_unlock (&s->lock);
+	return NULL;
+}
+
+static bool
+outputstream_start (struct outputstream* s, unsigned int blocksize)
+{
+	s->blocksize = blocksize;
+	s->head = s->tail = s->count = 0;
+	s->stop                      = false;
+	for (unsigned int i = 0; i < WRITEBEHIND_BLOCKS; i++) {
+		s->blocks[i] = (float*)malloc (sizeof (float) * blocksize * s->numchannels);
+		if (!s->blocks[i]) {
+			while (i--) {
+				free (s->blocks[i]);
+			}
+			return false;
+		}
+	}
+	pthread_mutex_init (&s->lock, NULL);
+	pthread_cond_init (&s->cond, NULL);
+	if (pthread_create (&s->thread, NULL, outputstream_run, s)) {
+		pthread_mutex_destroy (&s->lock);
+		pthread_cond_destroy (&s->cond);
+		for (unsigned int i = 0; i < WRITEBEHIND_BLOCKS; i++) {
+			free (s->blocks[i]);
+		}
+		return false;
+	}
+	placement_pin_helper (s->thread);
+	return true;
+}
+
+/* Wait for the writer to drain all blocks, then join it */
+static void
+outputstream_stop (struct outputstream* s)
+{
+	pthread_mutex_lock (&s->lock);
+	s->stop = true;
+	pthread_cond_signal (&s->cond);
+	pthread_mutex_unlock (&s->lock);
+	pthread_join (s->thread, NULL);
+	pthread_mutex_destroy (&s->lock);
+	pthread_cond_destroy (&s->cond);
+	for (unsigned int i = 0; i < WRITEBEHIND_BLOCKS; i++) {
+		free (s->blocks[i]);
+	}
+}
+
+/* Get a free block to interleave the next frames into */
+static float*
+outputstream_acquire (struct outputstream* s)
+{
+	pthread_mutex_lock (&s->lock);
+	while (s->count == WRITEBEHIND_BLOCKS) {
+		pthread_cond_wait (&s->cond, &s->lock);
+	}
+	float* block = s->blocks[s->head];
+	pthread_mutex_unlock (&s->lock);
+	return block;
+}
+
+/* Queue the block returned by outputstream_acquire () for writing */
+static void
+outputstream_commit (struct outputstream* s, sf_count_t numframes)
+{
+	pthread_mutex_lock (&s->lock);
+	s->numframes[s->head] = numframes;
+	s->head               = (s->head + 1) % WRITEBEHIND_BLOCKS;
+	s->count++;
+	pthread_cond_signal (&s->cond);
+	pthread_mutex_unlock (&s->lock);
+}
+
+/* Sent by a --compare render: per output its channel count, block hashes
+ * and captured samples */
+static void
+outputstream_send_checksums (int fd, unsigned int numoutputs, const struct outputstream outputs[numoutputs])
+{
+	uint64_t count = numoutputs;
+	bool     ok    = write_all (fd, &count, sizeof (count));
+	for (unsigned int i = 0; ok && i < numoutputs; i++) {
+		const struct checksum* c = &outputs[i].checksum;
+		uint64_t header[3]       = { outputs[i].numchannels, c->numblocks, c->numcaptured };
+		ok                       = !c->failed && write_all (fd, header, sizeof (header)) && write_all (fd, c->hashes, sizeof (uint32_t) * c->numblocks) && write_all (fd, c->captured, sizeof (float) * c->numcaptured);
+	}
+	if (!ok) {
+		fprintf (stderr, "Error: Unable to send the checksums of the render\n");
+	}
+}
+
+/* ****************************************************************************
+ * Oversampling
+ *
+ * Cascaded polyphase half-band filters, one 2x stage per octave.  The filter
+ * is a Kaiser windowed sinc of 2 * HALFBAND_TAPS - 1 taps, of which only the
+ * centre and the HALFBAND_TAPS odd ones are non-zero.  Each filter delays by
+ * HALFBAND_CENTRE samples of the higher rate, one more than half its length.
+ */
+
+#define HALFBAND_TAPS 52
+#define HALFBAND_CENTRE HALFBAND_TAPS // keeps the latency of up to 3 stages integer
+
+struct halfband {
+	float history[2 * HALFBAND_TAPS];
+};
+
+static float          halfband_coeffs[HALFBAND_TAPS]; // h[2k + 1]
+static pthread_once_t halfband_once = PTHREAD_ONCE_INIT;
+
+static double
+bessel_i0 (double x)
+{
+	double sum = 1, term = 1;
+	for (int k = 1; k < 32; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+static void
+halfband_design ()
+{
+	const double beta = 8.0;
+	double       sum  = 0;
+	for (int k = 0; k < HALFBAND_TAPS; k++) {
+		double t   = 2 * k + 1 - HALFBAND_CENTRE; // odd, never 0
+		double r   = t / (2 * HALFBAND_CENTRE);
+		double win = bessel_i0 (beta * sqrt (1 - 4 * r * r)) / bessel_i0 (beta);
+		halfband_coeffs[k] = sin (M_PI * t / 2) / (M_PI * t) * win;
+		sum += halfband_coeffs[k];
+	}
+	/* unity DC gain of both polyphase branches */
+	for (int k = 0; k < HALFBAND_TAPS; k++) {
+		halfband_coeffs[k] *= 0.5 / sum;
+	}
+}
+
+/* n input samples to 2n output samples.  The loops run over the samples
+ * for a given tap, which the compiler vectorizes without reassociating. */
+static void
+halfband_up (struct halfband* hb, const float* in, unsigned int n, float* out)
+{
+	float work[HALFBAND_TAPS + n];
+	float odd[n];
+	memcpy (work, hb->history, sizeof (float) * HALFBAND_TAPS);
+	memcpy (work + HALFBAND_TAPS, in, sizeof (float) * n);
+	memset (odd, 0, sizeof (odd));
+	for (int k = 0; k < HALFBAND_TAPS; k++) {
+		const float  c = 2 * halfband_coeffs[k];
+		const float* x = work + HALFBAND_TAPS - k;
+		for (unsigned int i = 0; i < n; i++) {
+			odd[i] += c * x[i];
+		}
+	}
+	for (unsigned int i = 0; i < n; i++) {
+		out[2 * i]     = work[HALFBAND_TAPS - HALFBAND_CENTRE / 2 + i];
+		out[2 * i + 1] = odd[i];
+	}
+	memcpy (hb->history, work + n, sizeof (float) * HALFBAND_TAPS);
+}
+
+/* 2n input samples to n output samples */
+static void
+halfband_down (struct halfband* hb, const float* in, unsigned int n, float* out)
+{
+	float work[2 * HALFBAND_TAPS + 2 * n];
+	float even[HALFBAND_TAPS + n]; // deinterleaved, so that the taps run on unit stride
+	float odd[HALFBAND_TAPS + n];
+	memcpy (work, hb->history, sizeof (float) * 2 * HALFBAND_TAPS);
+	memcpy (work + 2 * HALFBAND_TAPS, in, sizeof (float) * 2 * n);
+	for (unsigned int i = 0; i < HALFBAND_TAPS + n; i++) {
+		even[i] = work[2 * i];
+		odd[i]  = work[2 * i + 1];
+	}
+	for (unsigned int i = 0; i < n; i++) {
+		out[i] = 0.5f * even[HALFBAND_TAPS + i - HALFBAND_CENTRE / 2];
+	}
+	for (int k = 0; k < HALFBAND_TAPS; k++) {
+		const float  c = halfband_coeffs[k];
+		const float* x = odd + HALFBAND_TAPS - 1 - k;
+		for (unsigned int i = 0; i < n; i++) {
+			out[i] += c * x[i];
+		}
+	}
+	memcpy (hb->history, work + 2 * n, sizeof (float) * 2 * HALFBAND_TAPS);
+}
+
+struct oversampler {
+	unsigned int     factor; // 1, 2, 4 or 8
+	unsigned int     numstages;
+	unsigned int     numin, numout;
+	float*           in;      // [numplugins][numin][blocksize * factor]
+	float*           out;     // [numplugins][numout][blocksize * factor]
+	float*           scratch; // 2 * blocksize * factor
+	struct halfband* up;      // [numplugins][numin][numstages]
+	struct halfband* down;    // [numplugins][numout][numstages]
+};
+
+static bool
+oversampler_init (struct oversampler* os, unsigned int factor, unsigned int numplugins, unsigned int numin, unsigned int numout, unsigned int blocksize)
+{
+	memset (os, 0, sizeof (struct oversampler));
+	os->factor = factor;
+	os->numin  = numin;
+	os->numout = numout;
+	while ((1U << os->numstages) < factor) {
+		os->numstages++;
+	}
+	if (factor == 1) {
+		return true;
+	}
+	pthread_once (&halfband_once, halfband_design);
+	size_t frames = (size_t)blocksize * factor;
+	os->in        = (float*)calloc (numplugins * numin * frames + 1, sizeof (float));
+	os->out       = (float*)calloc (numplugins * numout * frames + 1, sizeof (float));
+	os->scratch   = (float*)calloc (2 * frames, sizeof (float));
+	os->up        = (struct halfband*)calloc (numplugins * numin * os->numstages + 1, sizeof (struct halfband));
+	os->down      = (struct halfband*)calloc (numplugins * numout * os->numstages + 1, sizeof (struct halfband));
+	return os->in && os->out && os->scratch && os->up && os->down;
+}
+
+static void
+oversampler_free (struct oversampler* os)
+{
+	free (os->in);
+	free (os->out);
+	free (os->scratch);
+	free (os->up);
+	free (os->down);
+}
+
+/* Latency of the up- and downsampling filters, in frames at the base rate */
+static unsigned int
+oversampler_latency (const struct oversampler* os)
+{
+	unsigned int latency = 0;
+	for (unsigned int stage = 1; stage <= os->numstages; stage++) {
+		latency += 2 * HALFBAND_CENTRE >> stage;
+	}
+	return latency;
+}
+
+static void
+oversampler_up (struct oversampler* os, unsigned int numplugins, unsigned int numin, unsigned int blocksize, float pluginbuffers[numplugins][numin][blocksize])
+{
+	const size_t frames = (size_t)blocksize * os->factor;
+	for (unsigned int plugnum = 0; plugnum < numplugins; plugnum++) {
+		for (unsigned int port = 0; port < numin; port++) {
+			struct halfband* hb  = os->up + (plugnum * numin + port) * os->numstages;
+			const float*     src = pluginbuffers[plugnum][port];
+			float*           dst = os->in + (plugnum * numin + port) * frames;
+			unsigned int     n   = blocksize;
+			for (unsigned int stage = 0; stage < os->numstages; stage++, n *= 2) {
+				float* out = stage + 1 == os->numstages ? dst : os->scratch + (stage & 1) * frames;
+				halfband_up (&hb[stage], src, n, out);
+				src = out;
+			}
+		}
+	}
+}
+
+static void
+oversampler_down (struct oversampler* os, unsigned int numplugins, unsigned int numout, unsigned int blocksize, float outputbuffers[numplugins][numout][blocksize])
+{
+	const size_t frames = (size_t)blocksize * os->factor;
+	for (unsigned int plugnum = 0; plugnum < numplugins; plugnum++) {
+		for (unsigned int port = 0; port < numout; port++) {
+			struct halfband* hb  = os->down + (plugnum * numout + port) * os->numstages;
+			const float*     src = os->out + (plugnum * numout + port) * frames;
+			unsigned int     n   = frames / 2;
+			for (unsigned int stage = 0; stage < os->numstages; stage++, n /= 2) {
+				float* out = stage + 1 == os->numstages ? outputbuffers[plugnum][port] : os->scratch + (stage & 1) * frames;
+				halfband_down (&hb[stage], src, n, out);
+				src = out;
+			}
+		}
+	}
+}
+
+/* ****************************************************************************
+ * Sample rate conversion
+ *
+ * Streaming polyphase resampler for a rational ratio L/M, using Kaiser
+ * windowed sinc phases of a fixed number of taps.  The cutoff is set so that
+ * the stopband, about 80 dB down, starts at the lower of the two Nyquist
+ * frequencies; the response is flat to 93% of it.  The FIFO starts with half
+ * a filter of silence, so output frame k lines up with input time k * M / L
+ * and the conversion itself adds no delay to compensate.
+ */
+
+#define RESAMPLER_TAPS 128 // per phase when upsampling, more when downsampling
+#define RESAMPLER_BETA 8.0 // Kaiser window, about 80 dB of stopband attenuation
+#define RESAMPLER_TRANSITION 5.1 // width of the transition band of that window, in input frames / taps
+
+struct resampler {
+	unsigned int numchannels;
+	unsigned int L, M;   // output rate / input rate
+	unsigned int taps;   // per phase, multiple of 8
+	float*       coeffs; // [L][taps]
+	float*       fifo;   // [numchannels][capacity]
+	size_t       capacity, fifolen, pos;
+	unsigned int phase; // next output is at fifo position pos + phase / L
+};
+
+/* Everything the processing loop needs to know about rates */
+struct rateconversion {
+	double            filerate, pluginrate, outputrate; // pluginrate before oversampling
+	struct resampler* in;                               // NULL if the plugin runs at the file rate
+	struct resampler* out;                              // NULL if the output is written at the plugin rate
+	float*            resampled;                        // [numplugins][numout][outblocksize]
+	unsigned int      outblocksize;
+};
+
+static unsigned int
+gcd (unsigned int a, unsigned int b)
+{
+	while (b) {
+		unsigned int t = a % b;
+		a              = b;
+		b              = t;
+	}
+	return a;
+}
+
+/* Dot product with independent partial sums, which vectorizes as is */
+static inline float
+dot8 (const float* a, const float* b, unsigned int n)
+{
+	float acc[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	for (unsigned int j = 0; j < n; j += 8) {
+		for (unsigned int q = 0; q < 8; q++) {
+			acc[q] += a[j + q] * b[j + q];
+		}
+	}
+	return ((acc[0] + acc[4]) + (acc[1] + acc[5])) + ((acc[2] + acc[6]) + (acc[3] + acc[7]));
+}
+
+/* maxin is the largest block pushed, maxout the largest pulled at once */
+static bool
+resampler_init (struct resampler* rs, unsigned int inrate, unsigned int outrate, unsigned int numchannels, size_t maxin, size_t maxout)
+{
+	unsigned int g  = gcd (inrate, outrate);
+	rs->numchannels = numchannels;
+	rs->L           = outrate / g;
+	rs->M           = inrate / g;
+	double ratio    = rs->L < rs->M ? (double)rs->L / rs->M : 1.0;
+	double taps     = ceil (RESAMPLER_TAPS / ratio);
+	rs->taps        = ((unsigned int)(taps < 2048 ? taps : 2048) + 7) & ~7U;
+	/* the stopband starts at the lower of both Nyquist frequencies */
+	double cutoff = ratio - RESAMPLER_TRANSITION / rs->taps;
+	rs->capacity    = rs->taps + 2 * maxin + (size_t)ceil ((double)(maxout + 2) * rs->M / rs->L) + 16;
+	rs->coeffs      = (float*)malloc (sizeof (float) * rs->L * rs->taps);
+	rs->fifo        = (float*)calloc (rs->capacity * numchannels, sizeof (float));
+	rs->fifolen     = rs->taps / 2 - 1;
+	rs->pos         = 0;
+	rs->phase       = 0;
+	if (!rs->coeffs || !rs->fifo) {
+		return false;
+	}
+
+	const double half = rs->taps / 2;
+	for (unsigned int p = 0; p < rs->L; p++) {
+		float* c   = rs->coeffs + (size_t)p * rs->taps;
+		double sum = 0;
+		for (unsigned int j = 0; j < rs->taps; j++) {
+			double t = j - (half - 1) - (double)p / rs->L;
+			double r = t / half;
+			double x = M_PI * cutoff * t;
+			c[j]     = (fabs (x) < 1e-9 ? 1 : sin (x) / x) * bessel_i0 (RESAMPLER_BETA * sqrt (fmax (0, 1 - r * r))) / bessel_i0 (RESAMPLER_BETA);
+			sum += c[j];
+		}
+		for (unsigned int j = 0; j < rs->taps; j++) {
+			c[j] /= sum;
+		}
+	}
+	return true;
+}
+
+static void
+resampler_free (struct resampler* rs)
+{
+	free (rs->coeffs);
+	free (rs->fifo);
+}
+
+/* FIFO length needed to produce n more frames */
+static size_t
+resampler_needed (const struct resampler* rs, size_t n)
+{
+	return rs->pos + (rs->phase + (n - 1) * (unsigned long long)rs->M) / rs->L + rs->taps;
+}
+
+/* Append numframes frames, sample c of frame i being src[c * chanstride + i * framestride] */
+static void
+resampler_push (struct resampler* rs, const float* src, size_t numframes, size_t chanstride, size_t framestride)
+{
+	if (rs->pos) {
+		for (unsigned int c = 0; c < rs->numchannels; c++) {
+			float* fifo = rs->fifo + c * rs->capacity;
+			memmove (fifo, fifo + rs->pos, sizeof (float) * (rs->fifolen - rs->pos));
+		}
+		rs->fifolen -= rs->pos;
+		rs->pos = 0;
+	}
+	for (unsigned int c = 0; c < rs->numchannels; c++) {
+		float* fifo = rs->fifo + c * rs->capacity + rs->fifolen;
+		for (size_t i = 0; i < numframes; i++) {
+			fifo[i] = src[c * chanstride + i * framestride];
+		}
+	}
+	rs->fifolen += numframes;
+}
+
+/* Produce up to maxframes frames, as far as the FIFO allows */
+static size_t
+resampler_pull (struct resampler* rs, float* dst, size_t maxframes, size_t chanstride, size_t framestride)
+{
+	size_t n = 0;
+	while (n < maxframes && rs->pos + rs->taps <= rs->fifolen) {
+		const float* coeffs = rs->coeffs + (size_t)rs->phase * rs->taps;
+		for (unsigned int c = 0; c < rs->numchannels; c++) {
+			dst[c * chanstride + n * framestride] = dot8 (coeffs, rs->fifo + c * rs->capacity + rs->pos, rs->taps);
+		}
+		n++;
+		rs->phase += rs->M;
+		rs->pos += rs->phase / rs->L;
+		rs->phase %= rs->L;
+	}
+	return n;
+}
+
+/* ****************************************************************************
+ * LV2 Worker
+ */
+
+/* the schedule and respond handle, one per instance */
+struct worker {
+	const LV2_Worker_Interface* iface;
+	LV2_Handle                  instance;
+};
+
+static LV2_Worker_Status
+lv2_worker_respond (LV2_Worker_Respond_Handle handle,
+                    uint32_t                  size,
+                    const void*               data)
+{
+	struct worker* worker = (struct worker*)handle;
+	worker->iface->work_response (worker->instance, size, data);
+	return LV2_WORKER_SUCCESS;
+}
+
+static LV2_Worker_Status
+lv2_worker_schedule (LV2_Worker_Schedule_Handle handle,
+                     uint32_t                   size,
+                     const void*                data)
+{
+	/* all processing is non-realtime, scheduled work can be executed immediately */
+	struct worker* worker = (struct worker*)handle;
+	worker->iface->work (worker->instance, lv2_worker_respond, worker, size, data);
+	return LV2_WORKER_SUCCESS;
+}
+
+/* ****************************************************************************
+ * LV2 State
+ */
+struct portsymbol {
+	const char* symbol;
+	uint32_t    port;
+};
+
+struct statehelper {
+	const LilvPlugin*  plugin;
+	uint32_t           numports;
+	float*             params;
+	LV2_URID           atom_Float;
+	struct portsymbol* symbols; // sorted by symbol
+};
+
+static int
+compare_portsymbols (const void* a, const void* b)
+{
+	return strcmp (((const struct portsymbol*)a)->symbol, ((const struct portsymbol*)b)->symbol);
+}
+
+static bool
+statehelper_init (struct statehelper* sh, const LilvPlugin* plugin, uint32_t numports, float* params)
+{
+	sh->plugin     = plugin;
+	sh->numports   = numports;
+	sh->params     = params;
+	sh->atom_Float = uri_to_id (NULL, "http://lv2plug.in/ns/ext/atom#Float");
+	sh->symbols    = (struct portsymbol*)malloc (sizeof (struct portsymbol) * numports + 1);
+	if (!sh->symbols) {
+		return false;
+	}
+	for (uint32_t port = 0; port < numports; ++port) {
+		sh->symbols[port].symbol = lilv_node_as_string (lilv_port_get_symbol (plugin, lilv_plugin_get_port_by_index (plugin, port)));
+		sh->symbols[port].port   = port;
+	}
+	qsort (sh->symbols, numports, sizeof (struct portsymbol), compare_portsymbols);
+	return true;
+}
+
+static void
+set_port_value (const char* port_symbol,
+                void*       user_data,
+                const void* value,
+                uint32_t    size,
+                uint32_t    type)
+{
+	struct statehelper* sh = (struct statehelper*)user_data;
+	if (type != 0 && type != sh->atom_Float) {
+		return;
+	}
+	(void)size; // unused
+	float val = *(const float*)value;
+	//printf ("STATE set %s to %f (t: %d)\n", port_symbol, val, type);
+	struct portsymbol  key   = { port_symbol, 0 };
+	struct portsymbol* found = (struct portsymbol*)bsearch (&key, sh->symbols, sh->numports, sizeof (struct portsymbol), compare_portsymbols);
+	if (found) {
+		sh->params[found->port] = val;
+	}
+}
+
+/* The port values of a state are emitted once into the defaults; only its
+ * other properties are restored into every instance, by several threads */
+struct restorejob {
+	const LilvState*           state;
+	unsigned int               numinstances;
+	LilvInstance**             instances;
+	const LV2_Feature* const** features;
+	unsigned int               next;
+};
+
+static void*
+restore_state_run (void* arg)
+{
+	struct restorejob* job = (struct restorejob*)arg;
+	for (;;) {
+		unsigned int i = __atomic_fetch_add (&job->next, 1, __ATOMIC_RELAXED);
+		if (i >= job->numinstances) {
+			return NULL;
+		}
+		lilv_state_restore (job->state, job->instances[i], NULL, NULL, 0, job->features[i]);
+	}
+}
+
+static void
+restore_state (const LilvState* state, unsigned int numinstances, LilvInstance* instances[numinstances], const LV2_Feature* const* features[numinstances])
+{
+	struct restorejob job        = { state, numinstances, instances, features, 0 };
+	long              numthreads = sysconf (_SC_NPROCESSORS_ONLN);
+	if (numthreads > numinstances) {
+		numthreads = numinstances;
+	}
+	pthread_t    threads[numthreads > 1 ? numthreads - 1 : 1];
+	unsigned int numstarted = 0;
+	while (numstarted + 1 < numthreads && !pthread_create (&threads[numstarted], NULL, restore_state_run, &job)) {
+		placement_pin_helper (threads[numstarted]);
+		numstarted++;
+	}
+	restore_state_run (&job);
+	while (numstarted) {
+		pthread_join (threads[--numstarted], NULL);
+	}
+}
+
+/* ****************************************************************************
+ * Instance pool
+ *
+ * In --batch mode the plugin instances of a job are kept when it ends and
+ * handed to later jobs with the same plugin, sample rate, block size and
+ * features.  They are deactivated in between; activating them again resets
+ * them, and the preset is restored on top.  Idle instances beyond the memory
+ * limit are freed, least recently used first.
+ */
+
+struct hostedinstance {
+	LilvInstance*     instance;
+	const LilvPlugin* plugin;
+	double            rate;
+	int32_t           blocksize;
+	bool              has_worker;
+	size_t            memory; // resident memory taken by instantiating it
+	int               node;   // --numa: where it was created
+	unsigned long     lastuse;
+	bool              idle;
+	bool              active;
+
+	/* features, which must live as long as the instance */
+	LV2_URID_Map        uri_map;
+	LV2_Worker_Schedule schedule;
+	struct worker       worker;
+	LV2_Options_Option  options[5];
+	LV2_Feature         map_feature, unmap_feature, options_feature, schedule_feature;
+	const LV2_Feature*  features[5];
+};
+
+static struct {
+	bool                    enabled;
+	LilvWorld*              world; // shared by all jobs
+	size_t                  limit; // bytes of idle instances
+	struct hostedinstance** entries;
+	unsigned int            numentries, capacity;
+	unsigned long           clock;
+	unsigned int            created, reused;
+} pool = { false, NULL, 0, NULL, 0, 0, 0, 0, 0 };
+
+static size_t
+resident_memory (void)
+{
+	unsigned long size, resident = 0;
+	FILE*         statm = fopen ("/proc/self/statm", "r");
+	if (statm) {
+		if (fscanf (statm, "%lu %lu", &size, &resident) != 2) {
+			resident = 0;
+		}
+		fclose (statm);
+	}
+	return resident * sysconf (_SC_PAGESIZE);
+}
+
+static struct hostedinstance*
+hostedinstance_new (const LilvPlugin* plugin, double rate, int32_t blocksize, bool has_worker)
+{
+	struct hostedinstance* h = (struct hostedinstance*)calloc (1, sizeof (struct hostedinstance));
+	if (!h) {
+		return NULL;
+	}
+	h->plugin     = plugin;
+	h->rate       = rate;
+	h->blocksize  = blocksize;
+	h->has_worker = has_worker;
+	h->node       = placement_node;
+
+	LV2_URID                 atom_Int = uri_to_id (NULL, LV2_ATOM__Int);
+	const LV2_Options_Option options[] = {
+		{ LV2_OPTIONS_INSTANCE, 0, uri_to_id (NULL, LV2_BUF_SIZE__minBlockLength),
+		  sizeof (int32_t), atom_Int, &h->blocksize },
+		{ LV2_OPTIONS_INSTANCE, 0, uri_to_id (NULL, LV2_BUF_SIZE__maxBlockLength),
+		  sizeof (int32_t), atom_Int, &h->blocksize },
+		{ LV2_OPTIONS_INSTANCE, 0, uri_to_id (NULL, LV2_BUF_SIZE__sequenceSize),
+		  sizeof (int32_t), atom_Int, &atom_capacity },
+		{ LV2_OPTIONS_INSTANCE, 0, uri_to_id (NULL, "http://lv2plug.in/ns/ext/buf-size#nominalBlockLength"),
+		  sizeof (int32_t), atom_Int, &h->blocksize },
+		{ LV2_OPTIONS_INSTANCE, 0, 0, 0, 0, NULL }
+	};
+	memcpy (h->options, options, sizeof (options));
+
+	h->uri_map.handle  = NULL;
+	h->uri_map.map     = &uri_to_id;
+	h->map_feature     = (LV2_Feature){ LV2_URID__map, &h->uri_map };
+	h->unmap_feature   = (LV2_Feature){ LV2_URID__unmap, NULL };
+	h->options_feature = (LV2_Feature){ LV2_OPTIONS__options, h->options };
+
+	int n_features           = 0;
+	h->features[n_features++] = &h->map_feature;
+	h->features[n_features++] = &h->unmap_feature;
+	h->features[n_features++] = &h->options_feature;
+	if (has_worker) {
+		h->schedule.handle        = &h->worker;
+		h->schedule.schedule_work = lv2_worker_schedule;
+		h->schedule_feature       = (LV2_Feature){ LV2_WORKER__schedule, &h->schedule };
+		h->features[n_features++] = &h->schedule_feature;
+	}
+	h->features[n_features] = NULL;
+
+	size_t before = resident_memory ();
+	h->instance   = lilv_plugin_instantiate (plugin, rate, h->features);
+	if (!h->instance) {
+		free (h);
+		return NULL;
+	}
+	if (has_worker) {
+		h->worker.iface    = (const LV2_Worker_Interface*)lilv_instance_get_extension_data (h->instance, LV2_WORKER__interface);
+		h->worker.instance = h->instance->lv2_handle;
+	}
+	size_t after = resident_memory ();
+	h->memory    = after > before ? after - before : 0;
+	return h;
+}
+
+static void
+hostedinstance_free (struct hostedinstance* h)
+{
+	lilv_instance_free (h->instance);
+	free (h);
+}
+
+/* An idle pooled instance matching the job, or a new one */
+static struct hostedinstance*
+pool_acquire (const LilvPlugin* plugin, double rate, int32_t blocksize, bool has_worker)
+{
+	struct hostedinstance* found = NULL;
+	for (unsigned int i = 0; i < pool.numentries; i++) {
+		struct hostedinstance* h = pool.entries[i];
+		if (h->idle && h->plugin == plugin && h->rate == rate && h->blocksize == blocksize && h->has_worker == has_worker && (!placement.numa || h->node == placement_node) && (!found || h->lastuse > found->lastuse)) {
+			found = h;
+		}
+	}
+	if (found) {
+		found->idle = false;
+		pool.reused++;
+		metrics_add (&metrics.pool_hits, 1);
+		return found;
+	}
+	struct hostedinstance* h = hostedinstance_new (plugin, rate, blocksize, has_worker);
+	if (!h || !pool.enabled) {
+		return h;
+	}
+	pool.created++;
+	metrics_add (&metrics.pool_misses, 1);
+	if (pool.numentries == pool.capacity) {
+		unsigned int            capacity = pool.capacity ? 2 * pool.capacity : 16;
+		struct hostedinstance** entries  = (struct hostedinstance**)realloc (pool.entries, sizeof (struct hostedinstance*) * capacity);
+		if (!entries) {
+			return h; // not pooled, freed when released
+		}
+		pool.entries  = entries;
+		pool.capacity = capacity;
+	}
+	pool.entries[pool.numentries++] = h;
+	return h;
+}
+
+static void
+pool_remove (unsigned int i)
+{
+	hostedinstance_free (pool.entries[i]);
+	pool.entries[i] = pool.entries[--pool.numentries];
+}
+
+/* Free idle instances, least recently used first, until they fit the limit */
+static void
+pool_trim (void)
+{
+	for (;;) {
+		size_t idle   = 0;
+		int    oldest = -1;
+		for (unsigned int i = 0; i < pool.numentries; i++) {
+			if (pool.entries[i]->idle) {
+				idle += pool.entries[i]->memory;
+				if (oldest < 0 || pool.entries[i]->lastuse < pool.entries[oldest]->lastuse) {
+					oldest = i;
+				}
+			}
+		}
+		if (idle <= pool.limit || oldest < 0) {
+			return;
+		}
+		pool_remove (oldest);
+	}
+}
+
+/* Deactivate an instance, and keep it for later jobs if pooling */
+static void
+pool_release (struct hostedinstance* h)
+{
+	if (h->active) {
+		lilv_instance_deactivate (h->instance);
+		h->active = false;
+	}
+	for (unsigned int i = 0; i < pool.numentries; i++) {
+		if (pool.entries[i] == h) {
+			h->idle    = true;
+			h->lastuse = ++pool.clock;
+			pool_trim ();
+			return;
+		}
+	}
+	hostedinstance_free (h);
+}
+
+static void
+pool_free (void)
+{
+	while (pool.numentries) {
+		pool_remove (pool.numentries - 1);
+	}
+	free (pool.entries);
+	pool.entries  = NULL;
+	pool.capacity = 0;
+}
+
+/* ****************************************************************************
+ * Batch mode
+ */
+
+/* Copy the command line without the given options and their values */
+static int
+strip_options (int argc, char** argv, const char* const* options, char** args)
+{
+	int numargs = 0;
+	for (int i = 0; i < argc; i++) {
+		bool strip = false;
+		for (const char* const* option = options; *option && !strip; option++) {
+			size_t len = strlen (*option);
+			if (!strcmp (argv[i], *option)) {
+				strip = true;
+				i++;
+			} else {
+				strip = !strncmp (argv[i], *option, len) && argv[i][len] == '=';
+			}
+		}
+		if (!strip) {
+			args[numargs++] = argv[i];
+		}
+	}
+	args[numargs] = NULL;
+	return numargs;
+}
+
+/* Run the stripped command line on one input and output, or on the files it
+ * names itself if input is NULL */
+static void
+run_job (int numargs, char** args, const char* input, const char* output)
+{
+	/* the connections are parsed in place, so every job gets fresh copies */
+	char* jobargs[numargs + 5];
+	int   numjobargs = numargs;
+	for (int i = 0; i < numargs; i++) {
+		jobargs[i] = strdup (args[i]);
+	}
+	if (input) {
+		jobargs[numjobargs++] = strdup ("-i");
+		jobargs[numjobargs++] = strdup (input);
+		jobargs[numjobargs++] = strdup ("-o");
+		jobargs[numjobargs++] = strdup (output);
+	}
+	jobargs[numjobargs] = NULL;
+	main (numjobargs, jobargs);
+	for (int i = 0; i < numjobargs; i++) {
+		free (jobargs[i]);
+	}
+}
+
+/* Run the command line once per "INPUT OUTPUT" line of the list file, with
+ * the plugin world and instances shared between the jobs */
+static void
+run_batch (int argc, char** argv, const char* listfile)
+{
+	FILE* list = fopen (listfile, "r");
+	if (!list) {
+		fprintf (stderr, "Error opening batch list %s: %s\n", listfile, strerror (errno));
+		return;
+	}
+	static const char* const options[] = { "--batch", NULL };
+	char*                    args[argc + 1];
+	int                      numargs = strip_options (argc, argv, options, args);
+	char                     line[4096];
+	unsigned int             numjobs = 0;
+	while (fgets (line, sizeof (line), list)) {
+		line[strcspn (line, "\r\n")] = 0;
+		char* input                  = line + strspn (line, " \t");
+		if (!*input || *input == '#') {
+			continue;
+		}
+		/* a tab separates paths containing spaces */
+		char* separator = strchr (input, '\t');
+		if (!separator) {
+			separator = strchr (input, ' ');
+		}
+		if (!separator) {
+			fprintf (stderr, "Error: No output file given for %s in the batch list\n", input);
+			continue;
+		}
+		*separator   = 0;
+		char* output = separator + 1 + strspn (separator + 1, " \t");
+		printf ("Note: Batch job %u: %s -> %s\n", ++numjobs, input, output);
+		run_job (numargs, args, input, output);
+	}
+	fclose (list);
+	printf ("Note: Ran %u jobs, created %u plugin instances and reused them %u times.\n", numjobs, pool.created, pool.reused);
+}
+
+/* ****************************************************************************
+ * Watch folder
+ *
+ * Files that are closed after writing, or moved into the watched directory,
+ * are queued and rendered into the output directory by a fixed number of
+ * workers.  When the queue is full the watcher stops taking events until a
+ * worker is free; the kernel keeps them meanwhile.  Hidden files and *.part
+ * files are ignored, so writers can rename a file into place when done.
+ *
+ * The jobs share the lilv world, which is not thread-safe: a job holds
+ * world_lock except while it processes audio.
+ */
+
+#define WATCH_QUEUE_PER_WORKER 2
+
+static pthread_mutex_t       world_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t watch_stop = 0;
+
+struct watchqueue {
+	char**       paths;
+	unsigned int capacity, head, count;
+	bool         closed;
+
+	pthread_mutex_t lock;
+	pthread_cond_t  notempty, notfull;
+
+	/* the job every worker runs */
+	int         numargs;
+	char**      args;
+	const char* outdir;
+	unsigned    numjobs;
+};
+
+static void
+watch_signal (int sig)
+{
+	(void)sig;
+	watch_stop = 1;
+}
+
+static void*
+watch_worker (void* arg)
+{
+	struct watchqueue* q = (struct watchqueue*)arg;
+	for (;;) {
+		pthread_mutex_lock (&q->lock);
+		while (!q->count && !q->closed) {
+			pthread_cond_wait (&q->notempty, &q->lock);
+		}
+		if (!q->count) {
+			pthread_mutex_unlock (&q->lock);
+			return NULL;
+		}
+		char* input = q->paths[q->head];
+		q->head     = (q->head + 1) % q->capacity;
+		q->count--;
+		__atomic_store_n (&metrics.queue_depth, q->count, __ATOMIC_RELAXED);
+		unsigned int job = ++q->numjobs;
+		pthread_cond_signal (&q->notfull);
+		pthread_mutex_unlock (&q->lock);
+
+		const char* name = strrchr (input, '/') + 1;
+		char        output[strlen (q->outdir) + strlen (name) + 2];
+		sprintf (output, "%s/%s", q->outdir, name);
+		printf ("Note: Watch job %u: %s -> %s\n", job, input, output);
+		run_job (q->numargs, q->args, input, output);
+		free (input);
+	}
+}
+
+static void
+watch_push (struct watchqueue* q, char* path)
+{
+	pthread_mutex_lock (&q->lock);
+	while (q->count == q->capacity) {
+		pthread_cond_wait (&q->notfull, &q->lock);
+	}
+	q->paths[(q->head + q->count) % q->capacity] = path;
+	q->count++;
+	__atomic_store_n (&metrics.queue_depth, q->count, __ATOMIC_RELAXED);
+	pthread_cond_signal (&q->notempty);
+	pthread_mutex_unlock (&q->lock);
+}
+
+static void
+run_watch (int argc, char** argv, const char* dir, const char* outdir, unsigned int numworkers)
+{
+	char realdir[PATH_MAX], realoutdir[PATH_MAX];
+	if (realpath (dir, realdir) && realpath (outdir, realoutdir) && !strcmp (realdir, realoutdir)) {
+		fprintf (stderr, "Error: The output directory must not be the watched one.\n");
+		return;
+	}
+	int notify = inotify_init1 (IN_CLOEXEC);
+	if (notify < 0 || inotify_add_watch (notify, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR) < 0) {
+		fprintf (stderr, "Error watching %s: %s\n", dir, strerror (errno));
+		if (notify >= 0) {
+			close (notify);
+		}
+		return;
+	}
+	static const char* const options[] = { "--watch", "--out-dir", "--workers", NULL };
+	char*                    args[argc + 1];
+	struct watchqueue        q = { 0 };
+	q.args                     = args;
+	q.numargs                  = strip_options (argc, argv, options, args);
+	q.outdir                   = outdir;
+	q.capacity                 = numworkers * WATCH_QUEUE_PER_WORKER;
+	q.paths                    = (char**)malloc (sizeof (char*) * q.capacity);
+	pthread_mutex_init (&q.lock, NULL);
+	pthread_cond_init (&q.notempty, NULL);
+	pthread_cond_init (&q.notfull, NULL);
+
+	/* stop on SIGINT and SIGTERM, after the queued jobs; the workers (and
+	 * their threads) block them so they interrupt the watcher */
+	sigset_t signals;
+	sigemptyset (&signals);
+	sigaddset (&signals, SIGINT);
+	sigaddset (&signals, SIGTERM);
+	pthread_sigmask (SIG_BLOCK, &signals, NULL);
+	pthread_t    workers[numworkers];
+	unsigned int numstarted = 0;
+	while (q.paths && numstarted < numworkers && !pthread_create (&workers[numstarted], NULL, watch_worker, &q)) {
+		numstarted++;
+	}
+	if (!numstarted) {
+		fprintf (stderr, "Error: Unable to start the workers\n");
+	}
+	struct sigaction action = { 0 };
+	action.sa_handler       = watch_signal;
+	sigaction (SIGINT, &action, NULL);
+	sigaction (SIGTERM, &action, NULL);
+	pthread_sigmask (SIG_UNBLOCK, &signals, NULL);
+	if (numstarted) {
+		printf ("Note: Watching %s with %u workers, press Ctrl-C to stop.\n", dir, numstarted);
+	}
+
+	char events[sizeof (struct inotify_event) + NAME_MAX + 1] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+	while (numstarted && !watch_stop) {
+		ssize_t len = read (notify, events, sizeof (events)); // blocks, interrupted by the signals
+		if (len <= 0) {
+			if (len < 0 && errno != EINTR) {
+				fprintf (stderr, "Error watching %s: %s\n", dir, strerror (errno));
+				break;
+			}
+			continue;
+		}
+		for (char* e = events; e < events + len;) {
+			const struct inotify_event* event = (const struct inotify_event*)e;
+			e += sizeof (struct inotify_event) + event->len;
+			if (event->mask & IN_Q_OVERFLOW) {
+				fprintf (stderr, "WARNING: Too many files at once, some were missed.\n");
+			}
+			size_t namelen = event->len ? strlen (event->name) : 0;
+			if (!namelen || (event->mask & IN_ISDIR) || event->name[0] == '.' || (namelen > 5 && !strcmp (event->name + namelen - 5, ".part"))) {
+				continue;
+			}
+			char* path = (char*)malloc (strlen (dir) + namelen + 2);
+			sprintf (path, "%s/%s", dir, event->name);
+			watch_push (&q, path);
+		}
+	}
+
+	pthread_mutex_lock (&q.lock);
+	q.closed = true;
+	pthread_cond_broadcast (&q.notempty);
+	pthread_mutex_unlock (&q.lock);
+	while (numstarted) {
+		pthread_join (workers[--numstarted], NULL);
+	}
+	printf ("Note: Ran %u jobs, created %u plugin instances and reused them %u times.\n", q.numjobs, pool.created, pool.reused);
+	pthread_mutex_destroy (&q.lock);
+	pthread_cond_destroy (&q.notempty);
+	pthread_cond_destroy (&q.notfull);
+	free (q.paths);
+	close (notify);
+}
+
+/* ****************************************************************************
+ * Preview
+ *
+ * --preview renders N excerpts spread evenly over the input instead of all
+ * of it.  Every excerpt is a job of its own, on its own plugin instances,
+ * which starts a pre-roll before the excerpt so the plugin has settled when
+ * the excerpt begins; the pre-roll is rendered but not kept.  The jobs run
+ * in parallel and either write one file per excerpt, when the output name
+ * contains {excerpt}, or keep their outputs in memory to be joined with
+ * short equal-power crossfades.
+ */
+
+#define PREVIEW_CROSSFADE 0.02 // seconds
+
+struct previewjobs {
+	int             numargs;
+	char**          args;
+	unsigned int    numexcerpts;
+	struct excerpt* excerpts;
+	unsigned int    next;
+};
+
+/* Take over the collected outputs of a finished excerpt job */
+static void
+preview_collect (struct excerpt* excerpt, unsigned int numoutputs, struct outputstream outputs[numoutputs])
+{
+	excerpt->outputs = (struct excerptoutput*)calloc (numoutputs, sizeof (struct excerptoutput));
+	if (!excerpt->outputs) {
+		return;
+	}
+	for (unsigned int i = 0; i < numoutputs; i++) {
+		if (outputs[i].failed) {
+			continue;
+		}
+		excerpt->outputs[i] = (struct excerptoutput){ strdup (outputs[i].path), outputs[i].info, outputs[i].memory, outputs[i].memframes };
+		outputs[i].memory   = NULL;
+	}
+	excerpt->numoutputs = numoutputs;
+}
+
+static void*
+preview_worker (void* arg)
+{
+	struct previewjobs* jobs = (struct previewjobs*)arg;
+	for (;;) {
+		unsigned int i = __atomic_fetch_add (&jobs->next, 1, __ATOMIC_RELAXED);
+		if (i >= jobs->numexcerpts) {
+			return NULL;
+		}
+		current_excerpt = &jobs->excerpts[i];
+		run_job (jobs->numargs, jobs->args, NULL, NULL);
+		current_excerpt = NULL;
+	}
+}
+
+/* Write the excerpts one after the other, every one fading into the next */
+static bool
+preview_join (unsigned int numexcerpts, struct excerpt excerpts[numexcerpts])
+{
+	for (unsigned int e = 0; e < numexcerpts; e++) {
+		if (excerpts[e].numoutputs != excerpts[0].numoutputs) {
+			fprintf (stderr, "Error: Excerpt %u failed, not writing the preview.\n", e + 1);
+			return false;
+		}
+		for (unsigned int stream = 0; stream < excerpts[e].numoutputs; stream++) {
+			if (!excerpts[e].outputs[stream].path) {
+				fprintf (stderr, "Error: Excerpt %u failed, not writing the preview.\n", e + 1);
+				return false;
+			}
+		}
+	}
+	bool ok = excerpts[0].numoutputs > 0;
+	for (unsigned int stream = 0; stream < excerpts[0].numoutputs; stream++) {
+		const struct excerptoutput* first      = &excerpts[0].outputs[stream];
+		SF_INFO                     info       = first->info;
+		SNDFILE*                    file       = sf_open (first->path, SFM_WRITE, &info);
+		int                         sndfileerr = sf_error (file);
+		if (sndfileerr) {
+			fprintf (stderr, "Error opening output file %s: %s\n", first->path, sf_error_number (sndfileerr));
+			ok = false;
+			continue;
+		}
+		const unsigned int channels = info.channels;
+		const sf_count_t   fade     = llround (PREVIEW_CROSSFADE * info.samplerate);
+		float*             mixed    = (float*)malloc (sizeof (float) * (fade + 1) * channels);
+		const float*       tail     = NULL; // end of the previous excerpt, not written yet
+		sf_count_t         fadein   = 0, total = 0;
+		bool               failed   = !mixed;
+		for (unsigned int e = 0; e < numexcerpts && !failed; e++) {
+			const struct excerptoutput* o = &excerpts[e].outputs[stream];
+			/* short excerpts get shorter crossfades */
+			sf_count_t fadeout = 0;
+			if (e + 1 < numexcerpts) {
+				sf_count_t next = excerpts[e + 1].outputs[stream].numframes / 2;
+				fadeout         = o->numframes / 2 < fade ? o->numframes / 2 : fade;
+				fadeout         = next < fadeout ? next : fadeout;
+			}
+			for (sf_count_t f = 0; f < fadein; f++) {
+				double angle = M_PI / 2 * (f + 0.5) / fadein;
+				float  out   = cos (angle), in = sin (angle);
+				for (unsigned int c = 0; c < channels; c++) {
+					mixed[f * channels + c] = tail[f * channels + c] * out + o->samples[f * channels + c] * in;
+				}
+			}
+			sf_count_t body = o->numframes - fadein - fadeout;
+			failed          = sf_writef_float (file, mixed, fadein) != fadein || sf_writef_float (file, o->samples + fadein * channels, body) != body;
+			total += fadein + body;
+			tail   = o->samples + (o->numframes - fadeout) * channels;
+			fadein = fadeout;
+		}
+		if (failed) {
+			fprintf (stderr, "Error writing output file %s: %s\n", first->path, mixed ? sf_strerror (file) : "insufficient memory");
+			ok = false;
+		} else {
+			printf ("Note: Wrote %u excerpts, %.1f seconds, to %s.\n", numexcerpts, (double)total / info.samplerate, first->path);
+		}
+		free (mixed);
+		if (sf_close (file)) {
+			fprintf (stderr, "Error closing output file %s!\n", first->path);
+		}
+	}
+	return ok;
+}
+
+/* Render the excerpts described by spec, "<N>x<seconds>", of the input */
+static void
+run_preview (int argc, char** argv, const char* spec, double prerollseconds, const char* input, int numoutfiles, const char** outfiles)
+{
+	unsigned int numexcerpts;
+	double       seconds;
+	char         unit[2] = "";
+	/* the x may also be written as a multiplication sign */
+	if (sscanf (spec, "%u%*[x\xc3\x97]%lf%1s", &numexcerpts, &seconds, unit) < 2 || !numexcerpts || seconds <= 0 || (*unit && *unit != 's') || prerollseconds < 0) {
+		fprintf (stderr, "Error: --preview takes <N>x<seconds>, like 5x10s.\n");
+		return;
+	}
+	SF_INFO  info = { 0 };
+	SNDFILE* file = sf_open (input, SFM_READ, &info);
+	if (sf_error (file)) {
+		fprintf (stderr, "Error reading input file %s: %s\n", input, sf_error_number (sf_error (file)));
+		return;
+	}
+	sf_close (file);
+	sf_count_t length  = llround (seconds * info.samplerate);
+	sf_count_t preroll = llround (prerollseconds * info.samplerate);
+	if (info.frames <= 0) {
+		fprintf (stderr, "Error: The length of %s is unknown, it can not be previewed.\n", input);
+		return;
+	}
+	if (length > info.frames) {
+		length = info.frames;
+	}
+
+	bool join = true;
+	for (int i = 0; i < numoutfiles; i++) {
+		join &= !strstr (outfiles[i], "{excerpt}");
+	}
+	struct excerpt excerpts[numexcerpts];
+	for (unsigned int i = 0; i < numexcerpts; i++) {
+		/* centred in N equal parts of the input */
+		sf_count_t start = info.frames * (2 * i + 1) / (2 * (sf_count_t)numexcerpts) - length / 2;
+		start            = start < 0 ? 0 : (start > info.frames - length ? info.frames - length : start);
+		excerpts[i]      = (struct excerpt){ i + 1, start, length, start < preroll ? start : preroll, join, 0, NULL };
+		printf ("Note: Excerpt %u at %.1f seconds.\n", i + 1, (double)start / info.samplerate);
+	}
+
+	static const char* const options[] = { "--preview", "--preroll", NULL };
+	char*                    args[argc + 1];
+	struct previewjobs       jobs = { 0 };
+	jobs.args                     = args;
+	jobs.numargs                  = strip_options (argc, argv, options, args);
+	jobs.numexcerpts              = numexcerpts;
+	jobs.excerpts                 = excerpts;
+
+	long         numcpus    = sysconf (_SC_NPROCESSORS_ONLN);
+	unsigned int numworkers = numcpus > 0 && (unsigned long)numcpus < numexcerpts ? (unsigned int)numcpus : numexcerpts;
+	pthread_t    workers[numworkers];
+	unsigned int numstarted = 0;
+	while (numstarted < numworkers && !pthread_create (&workers[numstarted], NULL, preview_worker, &jobs)) {
+		numstarted++;
+	}
+	if (!numstarted) {
+		fprintf (stderr, "Error: Unable to start the workers\n");
+	}
+	while (numstarted) {
+		pthread_join (workers[--numstarted], NULL);
+	}
+	if (join && jobs.next) {
+		preview_join (numexcerpts, excerpts);
+	}
+	for (unsigned int i = 0; i < numexcerpts; i++) {
+		for (unsigned int stream = 0; stream < excerpts[i].numoutputs; stream++) {
+			free (excerpts[i].outputs[stream].path);
+			free (excerpts[i].outputs[stream].samples);
+		}
+		free (excerpts[i].outputs);
+	}
+}
+
+/* ****************************************************************************
+ * Plugin metadata
+ *
+ * --json prints the listings as JSON lines, one object per plugin with its
+ * ports, ranges, features and presets.  Loading the data of every plugin
+ * takes long on systems with many plugins, so the objects are kept in a
+ * cache file.  Its key covers the names and modification times of the
+ * directories in LV2_PATH and of the bundle directories in them, which
+ * change whenever a bundle or a file in it is added, removed or replaced, as
+ * installing does; checking it takes a stat () per bundle, not per file.
+ * The cache is rebuilt when the key changed.  lilv may load bundles from
+ * more directories than those, like the multiarch ones of its build, so the
+ * directories of the bundles it loaded are recorded in the cache and
+ * covered by the key as well.
+ */
+
+#define METADATA_VERSION 2
+#ifndef DEFAULT_LV2_PATH
+#define DEFAULT_LV2_PATH "~/.lv2:/usr/lib/lv2:/usr/local/lib/lv2"
+#endif
+
+struct metadatanodes {
+	LilvNode *input, *output, *audio, *control, *cv, *atom, *event, *midi, *preset, *label;
+};
+
+static void
+json_string (FILE* out, const char* s)
+{
+	fputc ('"', out);
+	for (; s && *s; s++) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\') {
+			fputc ('\\', out);
+			fputc (c, out);
+		} else if (c < 0x20) {
+			fprintf (out, "\\u%04x", c);
+		} else {
+			fputc (c, out);
+		}
+	}
+	fputc ('"', out);
+}
+
+/* A node as a JSON number, or null */
+static void
+json_number (FILE* out, const LilvNode* node)
+{
+	float value = node && (lilv_node_is_float (node) || lilv_node_is_int (node)) ? lilv_node_as_float (node) : NAN;
+	if (isfinite (value)) {
+		fprintf (out, "%.9g", value);
+	} else {
+		fputs ("null", out);
+	}
+}
+
+static void
+json_nodes (FILE* out, LilvNodes* nodes)
+{
+	bool first = true;
+	fputc ('[', out);
+	LILV_FOREACH (nodes, i, nodes)
+	{
+		if (!first) {
+			fputc (',', out);
+		}
+		json_string (out, lilv_node_as_string (lilv_nodes_get (nodes, i)));
+		first = false;
+	}
+	fputc (']', out);
+	lilv_nodes_free (nodes);
+}
+
+/* One line describing the plugin, starting with {"uri": */
+static void
+metadata_write_plugin (FILE* out, LilvWorld* world, const LilvPlugin* plugin, unsigned int index, const struct metadatanodes* n)
+{
+	LilvNode* name   = lilv_plugin_get_name (plugin);
+	LilvNode* author = lilv_plugin_get_author_name (plugin);
+	fputs ("{\"uri\":", out);
+	json_string (out, lilv_node_as_uri (lilv_plugin_get_uri (plugin)));
+	fprintf (out, ",\"index\":%u,\"name\":", index);
+	json_string (out, name ? lilv_node_as_string (name) : NULL);
+	fputs (",\"class\":", out);
+	json_string (out, lilv_node_as_string (lilv_plugin_class_get_label (lilv_plugin_get_class (plugin))));
+	fputs (",\"author\":", out);
+	json_string (out, author ? lilv_node_as_string (author) : NULL);
+	fputs (",\"bundle\":", out);
+	json_string (out, lilv_node_as_uri (lilv_plugin_get_bundle_uri (plugin)));
+	fprintf (out, ",\"latency\":%s,\"required_features\":", lilv_plugin_has_latency (plugin) ? "true" : "false");
+	json_nodes (out, lilv_plugin_get_required_features (plugin));
+	fputs (",\"optional_features\":", out);
+	json_nodes (out, lilv_plugin_get_optional_features (plugin));
+	lilv_node_free (name);
+	lilv_node_free (author);
+
+	/* inputs and outputs of audio, control, cv and atom/event ports */
+	unsigned int counts[2][4] = { { 0 } };
+	bool         midi_in      = false;
+	uint32_t     numports     = lilv_plugin_get_num_ports (plugin);
+	fputs (",\"ports\":[", out);
+	for (uint32_t port = 0; port < numports; port++) {
+		const LilvPort* p      = lilv_plugin_get_port_by_index (plugin, port);
+		bool            output = lilv_port_is_a (plugin, p, n->output);
+		int             type   = lilv_port_is_a (plugin, p, n->audio) ? 0 : lilv_port_is_a (plugin, p, n->control) ? 1 : lilv_port_is_a (plugin, p, n->cv) ? 2 : lilv_port_is_a (plugin, p, n->atom) || lilv_port_is_a (plugin, p, n->event) ? 3 : -1;
+		bool            midi   = type == 3 && lilv_port_supports_event (plugin, p, n->midi);
+		static const char* const types[] = { "audio", "control", "cv", "atom" };
+		if (type >= 0) {
+			counts[output][type]++;
+		}
+		midi_in |= midi && !output;
+		LilvNode *def, *min, *max;
+		lilv_port_get_range (plugin, p, &def, &min, &max);
+		LilvNode* portname = lilv_port_get_name (plugin, p);
+		fprintf (out, "%s{\"index\":%u,\"symbol\":", port ? "," : "", port);
+		json_string (out, lilv_node_as_string (lilv_port_get_symbol (plugin, p)));
+		fputs (",\"name\":", out);
+		json_string (out, portname ? lilv_node_as_string (portname) : NULL);
+		fprintf (out, ",\"direction\":\"%s\",\"type\":\"%s\",\"midi\":%s,\"default\":", output ? "output" : "input", type >= 0 ? types[type] : "other", midi ? "true" : "false");
+		json_number (out, def);
+		fputs (",\"minimum\":", out);
+		json_number (out, min);
+		fputs (",\"maximum\":", out);
+		json_number (out, max);
+		fputc ('}', out);
+		lilv_node_free (portname);
+		lilv_node_free (def);
+		lilv_node_free (min);
+		lilv_node_free (max);
+	}
+	fprintf (out, "],\"audio_in\":%u,\"audio_out\":%u,\"control_in\":%u,\"control_out\":%u,\"cv_in\":%u,\"cv_out\":%u,\"atom_in\":%u,\"atom_out\":%u,\"midi_in\":%s",
+	         counts[0][0], counts[1][0], counts[0][1], counts[1][1], counts[0][2], counts[1][2], counts[0][3], counts[1][3], midi_in ? "true" : "false");
+
+	fputs (",\"presets\":[", out);
+	LilvNodes* presets = lilv_plugin_get_related (plugin, n->preset);
+	bool       first   = true;
+	LILV_FOREACH (nodes, i, presets)
+	{
+		const LilvNode* preset = lilv_nodes_get (presets, i);
+		lilv_world_load_resource (world, preset);
+		LilvNodes* titles = lilv_world_find_nodes (world, preset, n->label, NULL);
+		if (titles) {
+			fprintf (out, "%s{\"uri\":", first ? "" : ",");
+			json_string (out, lilv_node_as_uri (preset));
+			fputs (",\"label\":", out);
+			json_string (out, lilv_node_as_string (lilv_nodes_get_first (titles)));
+			fputc ('}', out);
+			first = false;
+			lilv_nodes_free (titles);
+		}
+	}
+	lilv_nodes_free (presets);
+	fputs ("]}\n", out);
+}
+
+/* The end of the JSON value at p: after a string, object or array with all
+ * that is in it, at the comma or bracket after a number, true, false or null */
+static const char*
+json_skip (const char* p)
+{
+	int  depth    = 0;
+	bool instring = false;
+	for (; *p; p++) {
+		if (instring) {
+			if (*p == '\\' && p[1]) {
+				p++;
+			} else if (*p == '"') {
+				instring = false;
+				if (!depth) {
+					return p + 1;
+				}
+			}
+		} else if (*p == '"') {
+			instring = true;
+		} else if (*p == '{' || *p == '[') {
+			depth++;
+		} else if (*p == '}' || *p == ']') {
+			if (!depth) {
+				return p;
+			}
+			if (!--depth) {
+				return p + 1;
+			}
+		} else if (*p == ',' && !depth) {
+			return p;
+		}
+	}
+	return p;
+}
+
+/* The value of the top-level member key of one of our objects, which are
+ * written without whitespace; members of nested objects are skipped */
+static const char*
+json_find (const char* line, const char* key)
+{
+	const size_t keylen = strlen (key);
+	if (*line != '{') {
+		return NULL;
+	}
+	for (const char* p = line + 1; *p == '"';) {
+		const char* name = p + 1;
+		const char* end  = json_skip (p);
+		if (*end != ':') {
+			return NULL;
+		}
+		if ((size_t)(end - name - 1) == keylen && !strncmp (name, key, keylen)) {
+			return end + 1;
+		}
+		p = json_skip (end + 1);
+		if (*p != ',') {
+			return NULL;
+		}
+		p++;
+	}
+	return NULL;
+}
+
+/* A string member, decoded */
+static char*
+json_get_string (const char* line, const char* key)
+{
+	const char* value = json_find (line, key);
+	if (!value || *value != '"') {
+		return strdup ("");
+	}
+	char* text = (char*)malloc (strlen (value));
+	char* out  = text;
+	for (value++; *value && *value != '"'; value++) {
+		if (*value == '\\' && value[1] == 'u' && value[2] && value[3] && value[4] && value[5]) {
+			*out++ = strtol ((char[5]){ value[2], value[3], value[4], value[5], 0 }, NULL, 16);
+			value += 5;
+		} else {
+			value += *value == '\\' && value[1];
+			*out++ = *value;
+		}
+	}
+	*out = 0;
+	return text;
+}
+
+static uint64_t
+fnv1a (uint64_t hash, const void* data, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ ((const uint8_t*)data)[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+static uint64_t
+file_key (const char* path)
+{
+	struct stat st;
+	uint64_t    hash = fnv1a (14695981039346656037ULL, path, strlen (path));
+	if (!stat (path, &st)) {
+		int64_t stamp[3] = { st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+		hash             = fnv1a (hash, stamp, sizeof (stamp));
+	}
+	return hash;
+}
+
+static bool
+path_list_has (const char* list, const char* dir)
+{
+	const size_t len = strlen (dir);
+	for (const char* entry = list; entry && *entry;) {
+		size_t n = strcspn (entry, ":");
+		if (n == len && !strncmp (entry, dir, len)) {
+			return true;
+		}
+		entry += n + (entry[n] == ':');
+	}
+	return false;
+}
+
+/* Key of the directories in LV2_PATH and in the recorded dirs, each once,
+ * and of the bundles in them.  The entries are summed up, so the order
+ * readdir () returns them in does not matter. */
+static uint64_t
+metadata_key (const char* dirs)
+{
+	const char* lv2path = getenv ("LV2_PATH");
+	const char* home    = getenv ("HOME");
+	size_t      size    = strlen (lv2path ? lv2path : DEFAULT_LV2_PATH) + strlen (dirs) + 2;
+	char*       paths   = (char*)malloc (size);
+	if (!paths) {
+		return 0;
+	}
+	snprintf (paths, size, "%s:%s", lv2path ? lv2path : DEFAULT_LV2_PATH, dirs);
+	uint64_t key     = fnv1a (14695981039346656037ULL, paths, strlen (paths));
+	char*    save    = NULL;
+	char*    seen    = NULL;
+	size_t   seenlen = 0;
+	FILE*    visited = open_memstream (&seen, &seenlen);
+	for (char* dir = strtok_r (paths, ":", &save); dir; dir = strtok_r (NULL, ":", &save)) {
+		char path[PATH_MAX];
+		snprintf (path, sizeof (path), "%s%s", *dir == '~' && home ? home : "", *dir == '~' && home ? dir + 1 : dir);
+		if (visited) {
+			fflush (visited);
+			if (path_list_has (seen, path)) {
+				continue;
+			}
+			fprintf (visited, "%s:", path);
+		}
+		DIR* bundles = opendir (path);
+		if (!bundles) {
+			continue;
+		}
+		key += file_key (path);
+		for (struct dirent* bundle; (bundle = readdir (bundles));) {
+			if (bundle->d_name[0] != '.') {
+				char bundlepath[PATH_MAX];
+				snprintf (bundlepath, sizeof (bundlepath), "%s/%s", path, bundle->d_name);
+				key += file_key (bundlepath);
+			}
+		}
+		closedir (bundles);
+	}
+	if (visited) {
+		fclose (visited);
+	}
+	free (seen);
+	free (paths);
+	return key;
+}
+
+/* $XDG_CACHE_HOME/lv2file/plugins.jsonl, creating the directories */
+static bool
+metadata_cache_path (char* path, size_t size)
+{
+	const char* cache = getenv ("XDG_CACHE_HOME");
+	const char* home  = getenv ("HOME");
+	if (cache && *cache) {
+		snprintf (path, size, "%s", cache);
+	} else if (home) {
+		snprintf (path, size, "%s/.cache", home);
+	} else {
+		return false;
+	}
+	mkdir (path, 0777);
+	strncat (path, "/lv2file", size - strlen (path) - 1);
+	if (mkdir (path, 0777) && errno != EEXIST) {
+		return false;
+	}
+	strncat (path, "/plugins.jsonl", size - strlen (path) - 1);
+	return true;
+}
+
+/* The first line of the cache */
+static void
+metadata_header (FILE* out, const char* dirs)
+{
+	fprintf (out, "{\"lv2file\":\"metadata\",\"version\":%d,\"key\":\"%016llx\",\"dirs\":", METADATA_VERSION, (unsigned long long)metadata_key (dirs));
+	json_string (out, dirs);
+	fputs ("}\n", out);
+}
+
+/* The directories holding the bundles of the plugins, separated by colons */
+static char*
+metadata_dirs (const LilvPlugins* plugins)
+{
+	char*  dirs = NULL;
+	size_t len  = 0;
+	FILE*  out  = open_memstream (&dirs, &len);
+	if (!out) {
+		return NULL;
+	}
+	LILV_FOREACH (plugins, i, plugins)
+	{
+		char* path = lilv_file_uri_parse (lilv_node_as_uri (lilv_plugin_get_bundle_uri (lilv_plugins_get (plugins, i))), NULL);
+		if (!path) {
+			continue;
+		}
+		/* file:///usr/lib/lv2/foo.lv2/ to /usr/lib/lv2 */
+		size_t n = strlen (path);
+		while (n > 1 && path[n - 1] == '/') {
+			n--;
+		}
+		while (n > 1 && path[n - 1] != '/') {
+			n--;
+		}
+		path[n > 1 ? n - 1 : n] = 0;
+		fflush (out);
+		if (!path_list_has (dirs, path)) {
+			fprintf (out, "%s%s", len ? ":" : "", path);
+		}
+		lilv_free (path);
+	}
+	fclose (out);
+	return dirs;
+}
+
+/* Describe every plugin, under the key line */
+static bool
+metadata_build (FILE* out)
+{
+	LilvWorld* world = lilv_world_new ();
+	if (!world) {
+		return false;
+	}
+	lilv_world_load_all (world);
+	struct metadatanodes n = {
+		lilv_new_uri (world, LILV_URI_INPUT_PORT),
+		lilv_new_uri (world, LILV_URI_OUTPUT_PORT),
+		lilv_new_uri (world, LILV_URI_AUDIO_PORT),
+		lilv_new_uri (world, LILV_URI_CONTROL_PORT),
+		lilv_new_uri (world, LILV_URI_CV_PORT),
+		lilv_new_uri (world, LILV_URI_ATOM_PORT),
+		lilv_new_uri (world, LILV_URI_EVENT_PORT),
+		lilv_new_uri (world, LILV_URI_MIDI_EVENT),
+		lilv_new_uri (world, LV2_PRESETS__Preset),
+		lilv_new_uri (world, LILV_NS_RDFS "label"),
+	};
+	const LilvPlugins* plugins = lilv_world_get_all_plugins (world);
+	char*              dirs    = metadata_dirs (plugins);
+	metadata_header (out, dirs ? dirs : "");
+	free (dirs);
+	unsigned int index = 1;
+	LILV_FOREACH (plugins, i, plugins)
+	{
+		metadata_write_plugin (out, world, lilv_plugins_get (plugins, i), index++, &n);
+	}
+	LilvNode** nodes = (LilvNode**)&n;
+	for (size_t i = 0; i < sizeof (n) / sizeof (LilvNode*); i++) {
+		lilv_node_free (nodes[i]);
+	}
+	lilv_world_free (world);
+	return !ferror (out);
+}
+
+/* Print the lines of the plugin given by URI or number, or all of them */
+static bool
+metadata_print (FILE* cache, const char* plugin_name)
+{
+	int    index = plugin_name ? atoi (plugin_name) : 0;
+	char*  prefix = NULL;
+	size_t prefixlen = 0;
+	if (plugin_name && !index) {
+		FILE* p = open_memstream (&prefix, &prefixlen);
+		fputs ("{\"uri\":", p);
+		json_string (p, plugin_name);
+		fputc (',', p);
+		fclose (p);
+	}
+	char*   line   = NULL;
+	size_t  cap    = 0;
+	ssize_t len;
+	int     number = 0;
+	bool    found  = false;
+	while (!found && (len = getline (&line, &cap, cache)) > 0) {
+		number++;
+		if (!plugin_name || (index ? number == index : !strncmp (line, prefix, prefixlen))) {
+			fwrite (line, 1, len, stdout);
+			found = plugin_name != NULL;
+		}
+	}
+	free (line);
+	free (prefix);
+	return !plugin_name || found;
+}
+
+/* The cache, rebuilt if it is out of date, positioned after the key line */
+static FILE*
+metadata_open (void)
+{
+	char   path[PATH_MAX] = "";
+	bool   cached         = metadata_cache_path (path, sizeof (path));
+	FILE*  cache          = cached ? fopen (path, "r") : NULL;
+	char*  line           = NULL;
+	size_t cap            = 0;
+	if (cache) {
+		/* the key of the directories the cache names, as they are now */
+		char*  header = NULL;
+		size_t len    = 0;
+		FILE*  out    = getline (&line, &cap, cache) > 0 ? open_memstream (&header, &len) : NULL;
+		if (out) {
+			char* dirs = json_get_string (line, "dirs");
+			metadata_header (out, dirs);
+			fclose (out);
+			free (dirs);
+		}
+		if (!header || strcmp (line, header)) {
+			fclose (cache);
+			cache = NULL;
+		}
+		free (header);
+	}
+	if (!cache) {
+		/* written next to the cache and renamed, so readers never see half of it */
+		char temp[PATH_MAX + 16];
+		snprintf (temp, sizeof (temp), "%s.%d", path, (int)getpid ());
+		FILE* out   = cached ? fopen (temp, "w+") : NULL;
+		bool  named = out != NULL;
+		if (!named) {
+			out = tmpfile ();
+		}
+		if (!out || !metadata_build (out) || fflush (out)) {
+			fprintf (stderr, "Error: Unable to describe the plugins.\n");
+			if (out) {
+				fclose (out);
+			}
+			if (named) {
+				unlink (temp);
+			}
+			free (line);
+			return NULL;
+		}
+		if (named && rename (temp, path)) {
+			unlink (temp);
+		}
+		cache = out;
+		rewind (cache);
+		if (getline (&line, &cap, cache) <= 0) {
+			fclose (cache);
+			cache = NULL;
+		}
+	}
+	free (line);
+	return cache;
+}
+
+/* --json: list every plugin, or describe one */
+static void
+list_json (const char* plugin_name)
+{
+	FILE* cache = metadata_open ();
+	if (!cache) {
+		return;
+	}
+	if (!metadata_print (cache, plugin_name)) {
+		fprintf (stderr, "No such plugin %s\n", plugin_name);
+	}
+	fclose (cache);
+}
+
+/* ****************************************************************************
+ * Plugin search
+ *
+ * --search matches the plugins of the metadata cache against a query.  The
+ * cache is read into an index of the fields that can be searched, and every
+ * word of the query has to match, ignoring case:
+ *
+ *   reverb            URI, name, class or author contain "reverb"
+ *   class:delay       only the given field: uri, name, class or author
+ *   stereo in/out     the number of audio ports, also mono, quad or <n>ch,
+ *                     followed by in, out or in/out (the default)
+ *   midi              has a MIDI input
+ *
+ * Matches are printed with their URI first, which identifies the plugin for
+ * good, unlike the numbers of --list.
+ */
+
+enum { FIELD_URI, FIELD_NAME, FIELD_CLASS, FIELD_AUTHOR, NUM_FIELDS };
+
+static const char* const field_names[NUM_FIELDS] = { "uri", "name", "class", "author" };
+
+struct catalogentry {
+	char*        line; // the JSON object
+	char*        fields[NUM_FIELDS];
+	unsigned int audio_in, audio_out;
+	bool         midi_in;
+};
+
+static unsigned int
+json_get_uint (const char* line, const char* key)
+{
+	const char* value = json_find (line, key);
+	return value ? strtoul (value, NULL, 10) : 0;
 }
 
 static void
-free_uri_map ()
+catalog_free (size_t numentries, struct catalogentry* entries)
 {
-	for (uint32_t i = 0; i < urimap_len; ++i) {
-		free (urimap[i]);
+	for (size_t i = 0; i < numentries; i++) {
+		free (entries[i].line);
+		for (int field = 0; field < NUM_FIELDS; field++) {
+			free (entries[i].fields[field]);
+		}
 	}
-	free (urimap);
+	free (entries);
 }
 
-/* ****************************************************************************
- * LV2 Worker
- */
-static LV2_Worker_Interface* worker_iface = NULL;
-
-static LV2_Worker_Status
-lv2_worker_respond (LV2_Worker_Respond_Handle handle,
-                    uint32_t                  size,
-                    const void*               data)
+/* Read the cache into the index */
+static struct catalogentry*
+catalog_load (FILE* cache, size_t* numentries)
 {
-	worker_iface->work_response (handle, size, data);
-	return LV2_WORKER_SUCCESS;
+	struct catalogentry* entries  = NULL;
+	size_t               capacity = 0;
+	char*                line     = NULL;
+	size_t               cap      = 0;
+	*numentries                   = 0;
+	while (getline (&line, &cap, cache) > 0) {
+		if (*numentries == capacity) {
+			capacity                  = capacity ? 2 * capacity : 256;
+			struct catalogentry* more = (struct catalogentry*)realloc (entries, sizeof (struct catalogentry) * capacity);
+			if (!more) {
+				break;
+			}
+			entries = more;
+		}
+		struct catalogentry* e = &entries[(*numentries)++];
+		e->line                = line;
+		for (int field = 0; field < NUM_FIELDS; field++) {
+			e->fields[field] = json_get_string (line, field_names[field]);
+		}
+		e->audio_in  = json_get_uint (line, "audio_in");
+		e->audio_out = json_get_uint (line, "audio_out");
+		e->midi_in   = (json_find (line, "midi_in") && !strncmp (json_find (line, "midi_in"), "true", 4));
+		line         = NULL;
+		cap          = 0;
+	}
+	free (line);
+	return entries;
 }
 
-static LV2_Worker_Status
-lv2_worker_schedule (LV2_Worker_Schedule_Handle handle,
-                     uint32_t                   size,
-                     const void*                data)
+/* Number of channels of a word like stereo, or 0 */
+static unsigned int
+channel_word (const char* word)
 {
-	printf ("lv2_worker_schedule..\n");
-	/* all processing is non-realtime, scheduled work can be executed immediately */
-	worker_iface->work (handle, lv2_worker_respond, handle, size, data);
-	return LV2_WORKER_SUCCESS;
+	if (!strcasecmp (word, "mono")) {
+		return 1;
+	} else if (!strcasecmp (word, "stereo")) {
+		return 2;
+	} else if (!strcasecmp (word, "quad")) {
+		return 4;
+	}
+	/* <n>ch, anything else like 2, 3band or 10db is matched as text */
+	char*         end      = NULL;
+	unsigned long channels = isdigit ((unsigned char)*word) ? strtoul (word, &end, 10) : 0;
+	if (end && !strcasecmp (end, "ch") && channels <= UINT_MAX) {
+		return channels;
+	}
+	return 0;
 }
 
-/* ****************************************************************************
- * LV2 State
- */
-struct statehelper {
-	const LilvPlugin* plugin;
-	uint32_t          numports;
-	float*            params;
-};
+static bool
+catalog_match (const struct catalogentry* e, int numwords, char** words)
+{
+	for (int i = 0; i < numwords; i++) {
+		const char*  word     = words[i];
+		unsigned int channels = channel_word (word);
+		if (channels) {
+			const char* direction = i + 1 < numwords ? words[i + 1] : "";
+			bool        in = true, out = true;
+			if (!strcasecmp (direction, "in") || !strcasecmp (direction, "out")) {
+				in  = tolower ((unsigned char)direction[0]) == 'i';
+				out = !in;
+				i++;
+			} else if (!strcasecmp (direction, "in/out")) {
+				i++;
+			}
+			if ((in && e->audio_in != channels) || (out && e->audio_out != channels)) {
+				return false;
+			}
+			continue;
+		}
+		if (!strcasecmp (word, "midi")) {
+			if (!e->midi_in) {
+				return false;
+			}
+			continue;
+		}
+		int         first = 0, last = NUM_FIELDS;
+		const char* colon = strchr (word, ':');
+		for (int field = 0; colon && field < NUM_FIELDS; field++) {
+			if ((size_t)(colon - word) == strlen (field_names[field]) && !strncasecmp (word, field_names[field], colon - word)) {
+				first = field;
+				last  = field + 1;
+				word  = colon + 1;
+			}
+		}
+		bool found = false;
+		for (int field = first; !found && field < last; field++) {
+			found = strcasestr (e->fields[field], word) != NULL;
+		}
+		if (!found) {
+			return false;
+		}
+	}
+	return true;
+}
 
+/* --search: print the plugins matching the query, as JSON or one per line */
 static void
-set_port_value (const char* port_symbol,
-                void*       user_data,
-                const void* value,
-                uint32_t    size,
-                uint32_t    type)
+search_plugins (const char* query, bool json)
 {
-	if (type != 0 && type != uri_to_id (NULL, "http://lv2plug.in/ns/ext/atom#Float")) {
+	FILE* cache = metadata_open ();
+	if (!cache) {
 		return;
 	}
-	(void)size; // unused
-	float val = *(const float*)value;
-	//printf ("STATE set %s to %f (t: %d)\n", port_symbol, val, type);
-	struct statehelper* sh = (struct statehelper*)user_data;
-	for (uint32_t port = 0; port < sh->numports; ++port) {
-		const char* symbol = lilv_node_as_string (lilv_port_get_symbol (sh->plugin, lilv_plugin_get_port_by_index (sh->plugin, port)));
-		if (!strcmp (symbol, port_symbol)) {
-			//printf ("STATE actually set %d to %f\n", port, val);
-			sh->params[port] = val;
-			break;
+	size_t               numentries;
+	struct catalogentry* entries = catalog_load (cache, &numentries);
+	fclose (cache);
+
+	char* text = strdup (query);
+	char* words[strlen (text) / 2 + 1];
+	int   numwords = 0;
+	char* save     = NULL;
+	for (char* word = strtok_r (text, " \t", &save); word; word = strtok_r (NULL, " \t", &save)) {
+		words[numwords++] = word;
+	}
+	unsigned int found = 0;
+	for (size_t i = 0; i < numentries; i++) {
+		const struct catalogentry* e = &entries[i];
+		if (!catalog_match (e, numwords, words)) {
+			continue;
+		}
+		found++;
+		if (json) {
+			fputs (e->line, stdout);
+		} else {
+			printf ("%s\t%s\t%s\t%u in, %u out%s\n", e->fields[FIELD_URI], e->fields[FIELD_NAME], e->fields[FIELD_CLASS], e->audio_in, e->audio_out, e->midi_in ? ", MIDI" : "");
 		}
 	}
+	if (!found) {
+		fprintf (stderr, "No plugin matches %s\n", query);
+	}
+	free (text);
+	catalog_free (numentries, entries);
 }
 
 //From lv2_simple_jack_host in slv2 (GPL code)
@@ -170,6 +3752,49 @@ getplugin (const char* name, const LilvPlugins* plugins, LilvWorld* lilvworld)
 	}
 }
 
+struct connection {
+	unsigned int channel;  // sidechain channels follow those of the main inputs
+	unsigned int instance; // 0 based
+	const char*  port;
+};
+
+/* Parse one "[sc]CHANNEL:[INSTANCE.]PORT" connection */
+static bool
+parse_connection (char* text, unsigned int nummainchannels, unsigned int numsidechannels, struct connection* conn)
+{
+	bool  sidechain = !strncmp (text, "sc", 2);
+	char* colon     = strchr (text, ':');
+	if (!colon) {
+		fprintf (stderr, "Error parsing connection:  Expected colon between channel and port.\n");
+		return false;
+	}
+	*colon      = 0;
+	int channel = atoi (sidechain ? text + 2 : text) - 1;
+	if (sidechain && (channel < 0 || ((unsigned)channel) >= numsidechannels)) {
+		fprintf (stderr, "Sidechain inputs do not have channel %d.  They have %u channels.\n", channel + 1, numsidechannels);
+		return false;
+	} else if (!sidechain && (channel < 0 || ((unsigned)channel) >= nummainchannels)) {
+		fprintf (stderr, "Input sound files do not have channel %d.  They have %u channels.\n", channel + 1, nummainchannels);
+		return false;
+	}
+	conn->channel  = sidechain ? nummainchannels + channel : (unsigned)channel;
+	conn->instance = 0;
+	conn->port     = colon + 1;
+
+	char* period = strchr (colon + 1, '.');
+	if (period) {
+		*period      = 0;
+		int instance = atoi (colon + 1) - 1;
+		if (instance < 0) {
+			fprintf (stderr, "Invalid plugin instance specified\n");
+			return false;
+		}
+		conn->instance = instance;
+		conn->port     = period + 1;
+	}
+	return true;
+}
+
 unsigned int
 popcount (bool* connections, unsigned int numchannels)
 {
@@ -180,40 +3805,254 @@ popcount (bool* connections, unsigned int numchannels)
 	return result;
 }
 
+/* Presets of --input-matrix and --output-matrix */
+static const float ms_encode[] = { 0.5, 0.5, 0.5, -0.5 }; // L R -> M S
+static const float ms_decode[] = { 1, 1, 1, -1 };         // M S -> L R
+
+/* Parse a channel matrix: a preset, or rows separated by semicolons of
+ * numcolumns comma separated coefficients.  Every row is a channel of the
+ * result.  Returns the coefficients row by row, or NULL. */
+static float*
+parse_matrix (const char* spec, const float preset[4], unsigned int numcolumns, unsigned int* numrows)
+{
+	if (!strcasecmp (spec, "ms")) {
+		if (numcolumns != 2) {
+			fprintf (stderr, "Error: The ms matrix needs 2 channels, not %u.\n", numcolumns);
+			return NULL;
+		}
+		float* matrix = (float*)malloc (sizeof (float) * 4);
+		if (matrix) {
+			memcpy (matrix, preset, sizeof (float) * 4);
+			*numrows = 2;
+		}
+		return matrix;
+	}
+	unsigned int rows = 1;
+	for (const char* c = spec; *c; c++) {
+		rows += *c == ';';
+	}
+	float* matrix = (float*)malloc (sizeof (float) * rows * numcolumns);
+	if (!matrix) {
+		return NULL;
+	}
+	const char* p = spec;
+	for (unsigned int row = 0; row < rows; row++) {
+		for (unsigned int column = 0; column < numcolumns; column++) {
+			char* end;
+			matrix[row * numcolumns + column] = strtof (p, &end);
+			char separator = column + 1 < numcolumns ? ',' : row + 1 < rows ? ';' : 0;
+			if (end == p || !isfinite (matrix[row * numcolumns + column]) || *end != separator) {
+				fprintf (stderr, "Error: Invalid matrix %s, every row needs %u coefficients.\n", spec, numcolumns);
+				free (matrix);
+				return NULL;
+			}
+			p = end + 1;
+		}
+	}
+	*numrows = rows;
+	return matrix;
+}
+
+/* *** Specialised kernels */
+
+/* clang-format off */
+/* With the channel count fixed at compile time the compiler unrolls the
+ * channel loops and vectorizes across frames.  The common layouts (1->1,
+ * 2->2, N mono instances on N channels, ...) all connect input channel k to
+ * plugin buffer k and nothing else, which is a plain deinterleave.  The gain
+ * of every channel is applied on the way. */
+#define DEFINE_DEINTERLEAVE(N)                                                                   \
+	static void deinterleave##N (const float* restrict buffer, const float* restrict gains, unsigned int blocksize, float* restrict planar) \
+	{                                                                                            \
+		for (size_t i = 0; i < blocksize; i++) {                                                 \
+			for (size_t channel = 0; channel < N; channel++) {                                   \
+				planar[channel * blocksize + i] = buffer[i * N + channel] * gains[channel];      \
+			}                                                                                    \
+		}                                                                                        \
+	}
+#define DEFINE_INTERLEAVE(N)                                                                     \
+	static void interleave##N (const float* const* sources, unsigned int numframes, float* restrict block) \
+	{                                                                                            \
+		for (size_t i = 0; i < numframes; i++) {                                                 \
+			for (size_t channel = 0; channel < N; channel++) {                                   \
+				block[i * N + channel] = sources[channel][i];                                    \
+			}                                                                                    \
+		}                                                                                        \
+	}
+/* clang-format on */
+
+DEFINE_DEINTERLEAVE (1)
+DEFINE_DEINTERLEAVE (2)
+DEFINE_DEINTERLEAVE (4)
+DEFINE_DEINTERLEAVE (6)
+DEFINE_DEINTERLEAVE (8)
+DEFINE_INTERLEAVE (1)
+DEFINE_INTERLEAVE (2)
+
+/* clang-format off */
+/* Small matrices: every plugin buffer a weighted sum of the N input channels,
+ * and N file channels a weighted sum of N plugin outputs, like M/S */
+#define DEFINE_MIXMATRIX(N)                                                                      \
+	static void mixmatrix##N (const float* restrict buffer, const float* restrict coeffs, unsigned int blocksize, float* restrict out) \
+	{                                                                                            \
+		for (size_t i = 0; i < blocksize; i++) {                                                 \
+			float sum = 0;                                                                       \
+			for (size_t channel = 0; channel < N; channel++) {                                   \
+				sum += coeffs[channel] * buffer[i * N + channel];                                \
+			}                                                                                    \
+			out[i] = sum;                                                                        \
+		}                                                                                        \
+	}
+#define DEFINE_INTERLEAVE_MATRIX(N)                                                              \
+	static void interleavematrix##N (const float* const* sources, const float* restrict matrix, unsigned int numframes, float* restrict block) \
+	{                                                                                            \
+		for (size_t i = 0; i < numframes; i++) {                                                 \
+			for (size_t channel = 0; channel < N; channel++) {                                   \
+				float sum = 0;                                                                   \
+				for (size_t source = 0; source < N; source++) {                                  \
+					sum += matrix[channel * N + source] * sources[source][i];                    \
+				}                                                                                \
+				block[i * N + channel] = sum;                                                    \
+			}                                                                                    \
+		}                                                                                        \
+	}
+/* clang-format on */
+
+DEFINE_MIXMATRIX (1)
+DEFINE_MIXMATRIX (2)
+DEFINE_MIXMATRIX (4)
+DEFINE_INTERLEAVE_MATRIX (2)
+
+/* Returns the channel count when the coefficients are a plain
+ * deinterleave, with a gain per channel, 0 when they need the generic mix */
+unsigned int
+mix_layout (unsigned int numchannels, unsigned int numplugins, unsigned int numin, float coeffs[numplugins][numin][numchannels])
+{
+	if (numplugins * numin != numchannels) {
+		return 0;
+	}
+	for (unsigned int plugnum = 0; plugnum < numplugins; plugnum++) {
+		for (unsigned int port = 0; port < numin; port++) {
+			for (unsigned int channel = 0; channel < numchannels; channel++) {
+				if ((coeffs[plugnum][port][channel] != 0) != (channel == plugnum * numin + port)) {
+					return 0;
+				}
+			}
+		}
+	}
+	return numchannels;
+}
+
 void
-mix (float* buffer, sf_count_t framesread, unsigned int numchannels, unsigned int numplugins, unsigned int numin, bool connections[numplugins][numin][numchannels], unsigned int blocksize, float pluginbuffers[numplugins][numin][blocksize])
+mix (unsigned int layout, float* buffer, unsigned int numchannels, unsigned int numplugins, unsigned int numin, float coeffs[numplugins][numin][numchannels], unsigned int blocksize, float pluginbuffers[numplugins][numin][blocksize])
 {
-	for (unsigned int i = 0; i < framesread; i++) {
-		for (unsigned int plugnum = 0; plugnum < numplugins; plugnum++) {
-			for (unsigned int port = 0; port < numin; port++) {
-				unsigned int nummixed           = 0;
-				pluginbuffers[plugnum][port][i] = 0;
-				for (unsigned int channel = 0; channel < numchannels; channel++) {
-					if (connections[plugnum][port][channel]) {
-						nummixed++;
-						pluginbuffers[plugnum][port][i] += buffer[i * numchannels + channel];
+	float* planar = &pluginbuffers[0][0][0];
+	float  gains[layout ? layout : 1];
+	for (unsigned int channel = 0; channel < layout; channel++) {
+		gains[channel] = coeffs[channel / numin][channel % numin][channel];
+	}
+	switch (layout) {
+	case 1: deinterleave1 (buffer, gains, blocksize, planar); return;
+	case 2: deinterleave2 (buffer, gains, blocksize, planar); return;
+	case 4: deinterleave4 (buffer, gains, blocksize, planar); return;
+	case 6: deinterleave6 (buffer, gains, blocksize, planar); return;
+	case 8: deinterleave8 (buffer, gains, blocksize, planar); return;
+	}
+	for (unsigned int plugnum = 0; plugnum < numplugins; plugnum++) {
+		for (unsigned int port = 0; port < numin; port++) {
+			float*       out   = pluginbuffers[plugnum][port];
+			const float* coeff = coeffs[plugnum][port];
+			switch (numchannels) {
+			case 1: mixmatrix1 (buffer, coeff, blocksize, out); continue;
+			case 2: mixmatrix2 (buffer, coeff, blocksize, out); continue;
+			case 4: mixmatrix4 (buffer, coeff, blocksize, out); continue;
+			}
+			for (unsigned int i = 0; i < blocksize; i++) {
+				out[i] = 0;
+			}
+			for (unsigned int channel = 0; channel < numchannels; channel++) {
+				if (coeff[channel] != 0) {
+					for (unsigned int i = 0; i < blocksize; i++) {
+						out[i] += coeff[channel] * buffer[i * numchannels + channel];
 					}
 				}
-				if (nummixed) {
-					pluginbuffers[plugnum][port][i] /= nummixed;
-				}
 			}
 		}
 	}
 }
 
 void
-interleaveoutput (sf_count_t numread, unsigned int numplugins, unsigned int numout, unsigned int blocksize, float outputbuffers[numplugins][numout][blocksize], float sndfilebuffer[numout * blocksize])
+interleaveoutput (unsigned int offset, sf_count_t numframes, const struct outputstream* stream, float* block)
 {
-	for (unsigned int plugin = 0; plugin < numplugins; plugin++) {
-		for (unsigned int port = 0; port < numout; port++) {
-			for (unsigned int i = 0; i < numread; i++) {
-				sndfilebuffer[plugin * numout * blocksize + i * numout + port] = outputbuffers[plugin][port][i];
+	const unsigned int numchannels = stream->numchannels;
+	const unsigned int numsources  = stream->numsources;
+	const float*       sources[numsources];
+	for (unsigned int source = 0; source < numsources; source++) {
+		sources[source] = stream->sources[source] + offset;
+	}
+	if (stream->matrix) {
+		const float* matrix = stream->matrix;
+		if (numchannels == 2 && numsources == 2) {
+			interleavematrix2 (sources, matrix, numframes, block);
+			return;
+		}
+		for (unsigned int channel = 0; channel < numchannels; channel++) {
+			for (unsigned int i = 0; i < numframes; i++) {
+				block[i * numchannels + channel] = 0;
 			}
+			for (unsigned int source = 0; source < numsources; source++) {
+				const float coeff = matrix[channel * numsources + source];
+				for (unsigned int i = 0; coeff != 0 && i < numframes; i++) {
+					block[i * numchannels + channel] += coeff * sources[source][i];
+				}
+			}
+		}
+		return;
+	}
+	switch (numchannels) {
+	case 1: interleave1 (sources, numframes, block); return;
+	case 2: interleave2 (sources, numframes, block); return;
+	}
+	for (unsigned int channel = 0; channel < numchannels; channel++) {
+		const float* source = sources[channel];
+		for (unsigned int i = 0; i < numframes; i++) {
+			block[i * numchannels + channel] = source[i];
+		}
+	}
+}
+
+/* Largest magnitude in a buffer, with independent lanes that vectorize */
+static float
+peak8 (const float* buffer, size_t size)
+{
+	float  lanes[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	size_t i        = 0;
+	for (; i + 8 <= size; i += 8) {
+		for (unsigned int q = 0; q < 8; q++) {
+			float a  = fabsf (buffer[i + q]);
+			lanes[q] = a > lanes[q] ? a : lanes[q];
 		}
 	}
+	for (; i < size; i++) {
+		float a  = fabsf (buffer[i]);
+		lanes[0] = a > lanes[0] ? a : lanes[0];
+	}
+	for (unsigned int q = 1; q < 8; q++) {
+		lanes[0] = lanes[q] > lanes[0] ? lanes[q] : lanes[0];
+	}
+	return lanes[0];
 }
 
+/* State of --skip-silence */
+struct silenceskip {
+	bool        enabled;
+	float       threshold; // linear, blocks at or below it are silent
+	sf_count_t  hangover;  // silent input and output frames before an instance may skip
+	sf_count_t* quietframes;
+	sf_count_t* silentframes; // of the output, while the instance runs
+	sf_count_t  skipped, total; // instance frames
+};
+
 float
 getstartingvalue (float dflt, float min, float max)
 {
@@ -236,21 +4075,17 @@ getstartingvalue (float dflt, float min, float max)
 	}
 }
 
-inline char
+/* One branchless pass, so it vectorizes to min/max and compares.  Returns
+ * the number of clipped samples. */
+static inline unsigned long
 clipOutput (unsigned long size, float* buffer)
 {
-	char clipped = 0;
-	for (unsigned int i = 0; i < size; i++) {
-		if (buffer[i] > 1) {
-			clipped   = true;
-			buffer[i] = 1;
-		}
-	}
-	for (unsigned int i = 0; i < size; i++) {
-		if (buffer[i] < -1) {
-			clipped   = true;
-			buffer[i] = -1;
-		}
+	unsigned long clipped = 0;
+	for (unsigned long i = 0; i < size; i++) {
+		float x   = buffer[i];
+		clipped  += (x > 1) | (x < -1);
+		x         = x > 1 ? 1 : x;
+		buffer[i] = x < -1 ? -1 : x;
 	}
 	return clipped;
 }
@@ -273,63 +4108,630 @@ list_names (LilvWorld* lilvworld, const LilvPlugins* plugins, const char* plugin
 			printf ("%s: %s\n", lilv_node_as_string (lilv_port_get_symbol (plugin, p)), lilv_node_as_string (lilv_port_get_name (plugin, p)));
 		}
 	}
-	printf ("==Control Ports==\n");
-	for (uint32_t port = 0; port < numports; port++) {
-		const LilvPort* p = lilv_plugin_get_port_by_index (plugin, port);
-		if (lilv_port_is_a (plugin, p, input_class) && lilv_port_is_a (plugin, p, control_class)) {
-			printf ("%s: %s\n", lilv_node_as_string (lilv_port_get_symbol (plugin, p)), lilv_node_as_string (lilv_port_get_name (plugin, p)));
+	printf ("==Control Ports==\n");
+	for (uint32_t port = 0; port < numports; port++) {
+		const LilvPort* p = lilv_plugin_get_port_by_index (plugin, port);
+		if (lilv_port_is_a (plugin, p, input_class) && lilv_port_is_a (plugin, p, control_class)) {
+			printf ("%s: %s\n", lilv_node_as_string (lilv_port_get_symbol (plugin, p)), lilv_node_as_string (lilv_port_get_name (plugin, p)));
+		}
+	}
+	lilv_node_free (audio_class);
+	lilv_node_free (input_class);
+	lilv_node_free (control_class);
+}
+
+/* ****************************************************************************
+ * Output stage
+ *
+ * --limiter is a look-ahead brick-wall limiter: the gain every frame needs to
+ * stay below the ceiling is held at the minimum over the look-ahead, released
+ * exponentially and smoothed by a moving average over the look-ahead, so it
+ * has reached its value by the time the peak comes out of the delay line.
+ * The channels of an output file share the gain, which also lets it limit
+ * the sources of --output-matrix, whose peaks are found after the matrix, as
+ * the matrix is linear.  Finding the peaks and
+ * applying the gain vectorize; only the minimum, release and average run
+ * frame by frame, once for all channels.  The delay is compensated like the
+ * latency of the plugin.
+ *
+ * --soft-clip saturates smoothly from SOFTCLIP_KNEE of the ceiling up, never
+ * quite reaching the ceiling, and has no latency.
+ */
+
+#define LIMITER_LOOKAHEAD 5.0 // ms
+#define LIMITER_RELEASE 0.05  // seconds
+#define SOFTCLIP_KNEE 0.5     // -6 dB below the ceiling
+
+struct limiter {
+	unsigned int  numchannels;
+	float         ceiling;
+	sf_count_t    lookahead; // frames
+	float         release;   // per frame
+	const float** inputs;    // the sources of the output, before limiting
+	const float*  matrix;    // of --output-matrix, or NULL
+	unsigned int  numrows;
+	float*        outputs;   // a block per channel
+	float*        delay;     // lookahead - 1 frames per channel
+	float*        scratch;   // delay and block of one channel
+	float*        gain;      // per frame of the block
+
+	/* minimum of the last lookahead frames, a deque of ascending values in a
+	 * ring of lookahead + 1 */
+	float*      minvalues;
+	sf_count_t* minpositions;
+	sf_count_t  minhead, mincount;
+
+	float      held;    // minimum after the release
+	float*     average; // last lookahead values of held
+	sf_count_t averagepos;
+	sf_count_t position;
+};
+
+static void
+limiter_free (struct limiter* l)
+{
+	if (l) {
+		free (l->inputs);
+		free (l->outputs);
+		free (l->delay);
+		free (l->scratch);
+		free (l->gain);
+		free (l->minvalues);
+		free (l->minpositions);
+		free (l->average);
+		free (l);
+	}
+}
+
+/* Limit the channels read from sources, and point sources to the limited
+ * blocks instead */
+static struct limiter*
+limiter_new (unsigned int numchannels, const float** sources, const float* matrix, unsigned int numrows, float ceiling, double lookahead, double rate, unsigned int blocksize)
+{
+	struct limiter* l = (struct limiter*)calloc (1, sizeof (struct limiter));
+	if (!l) {
+		return NULL;
+	}
+	l->numchannels  = numchannels;
+	l->matrix       = matrix;
+	l->numrows      = numrows;
+	l->ceiling      = ceiling;
+	l->lookahead    = lookahead * rate > 1 ? llround (lookahead * rate) : 1;
+	l->release      = 1 - exp (-1 / (LIMITER_RELEASE * rate));
+	l->held         = 1;
+	l->inputs       = (const float**)malloc (sizeof (float*) * numchannels);
+	l->outputs      = (float*)malloc (sizeof (float) * numchannels * blocksize);
+	l->delay        = (float*)calloc ((size_t)numchannels * l->lookahead, sizeof (float));
+	l->scratch      = (float*)malloc (sizeof (float) * (l->lookahead + blocksize));
+	l->gain         = (float*)malloc (sizeof (float) * blocksize);
+	l->minvalues    = (float*)malloc (sizeof (float) * (l->lookahead + 1));
+	l->minpositions = (sf_count_t*)malloc (sizeof (sf_count_t) * (l->lookahead + 1));
+	l->average      = (float*)malloc (sizeof (float) * l->lookahead);
+	if (!l->inputs || !l->outputs || !l->delay || !l->scratch || !l->gain || !l->minvalues || !l->minpositions || !l->average) {
+		limiter_free (l);
+		return NULL;
+	}
+	for (sf_count_t i = 0; i < l->lookahead; i++) {
+		l->average[i] = 1;
+	}
+	for (unsigned int c = 0; c < numchannels; c++) {
+		l->inputs[c] = sources[c];
+		sources[c]   = l->outputs + (size_t)c * blocksize;
+	}
+	return l;
+}
+
+/* Frames the limiter delays its output by */
+static sf_count_t
+limiter_latency (const struct limiter* l)
+{
+	return l ? l->lookahead - 1 : 0;
+}
+
+static void
+limiter_process (struct limiter* l, sf_count_t numframes, unsigned int blocksize)
+{
+	const sf_count_t lookahead = l->lookahead;
+	const sf_count_t delay     = lookahead - 1;
+	float*           gain      = l->gain;
+
+	/* the gain that keeps every frame at the ceiling */
+	for (sf_count_t i = 0; i < numframes; i++) {
+		gain[i] = 0;
+	}
+	for (unsigned int c = 0; !l->matrix && c < l->numchannels; c++) {
+		const float* in = l->inputs[c];
+		for (sf_count_t i = 0; i < numframes; i++) {
+			float a = fabsf (in[i]);
+			gain[i] = a > gain[i] ? a : gain[i];
+		}
+	}
+	for (unsigned int row = 0; l->matrix && row < l->numrows; row++) {
+		float* out = l->scratch;
+		for (sf_count_t i = 0; i < numframes; i++) {
+			out[i] = 0;
+		}
+		for (unsigned int c = 0; c < l->numchannels; c++) {
+			const float  coeff = l->matrix[row * l->numchannels + c];
+			const float* in    = l->inputs[c];
+			for (sf_count_t i = 0; i < numframes; i++) {
+				out[i] += coeff * in[i];
+			}
+		}
+		for (sf_count_t i = 0; i < numframes; i++) {
+			float a = fabsf (out[i]);
+			gain[i] = a > gain[i] ? a : gain[i];
+		}
+	}
+	for (sf_count_t i = 0; i < numframes; i++) {
+		float peak = gain[i] > l->ceiling ? gain[i] : l->ceiling;
+		gain[i]    = l->ceiling / peak;
+	}
+
+	/* summed again every block, so the average does not drift */
+	double sum = 0;
+	for (sf_count_t i = 0; i < lookahead; i++) {
+		sum += l->average[i];
+	}
+	for (sf_count_t i = 0; i < numframes; i++) {
+		const float      v = gain[i];
+		const sf_count_t n = l->position + i;
+		while (l->mincount && l->minvalues[(l->minhead + l->mincount - 1) % (lookahead + 1)] >= v) {
+			l->mincount--;
+		}
+		sf_count_t back       = (l->minhead + l->mincount++) % (lookahead + 1);
+		l->minvalues[back]    = v;
+		l->minpositions[back] = n;
+		if (l->minpositions[l->minhead] <= n - lookahead) {
+			l->minhead = (l->minhead + 1) % (lookahead + 1);
+			l->mincount--;
+		}
+		const float minimum = l->minvalues[l->minhead];
+		const float release = l->held + (1 - l->held) * l->release;
+		l->held             = minimum < release ? minimum : release;
+		sum += l->held - l->average[l->averagepos];
+		l->average[l->averagepos] = l->held;
+		l->averagepos             = (l->averagepos + 1) % lookahead;
+		gain[i]                   = sum / lookahead;
+	}
+	l->position += numframes;
+
+	for (unsigned int c = 0; c < l->numchannels; c++) {
+		float* history = l->delay + (size_t)c * lookahead;
+		float* out     = l->outputs + (size_t)c * blocksize;
+		memcpy (l->scratch, history, sizeof (float) * delay);
+		memcpy (l->scratch + delay, l->inputs[c], sizeof (float) * numframes);
+		for (sf_count_t i = 0; i < numframes; i++) {
+			out[i] = l->scratch[i] * gain[i];
+		}
+		memcpy (history, l->scratch + numframes, sizeof (float) * delay);
+	}
+}
+
+/* Saturate smoothly from the knee towards the ceiling, with the curve
+ * knee + x / (1 + x) in units of ceiling - knee.  The curve is above the input
+ * below the knee, so the smaller of both is the output and no arithmetic
+ * depends on a branch, which lets it vectorize. */
+static void
+softclip (float ceiling, unsigned long size, float* buffer)
+{
+	const float knee  = ceiling * SOFTCLIP_KNEE;
+	const float width = ceiling - knee;
+	for (unsigned long i = 0; i < size; i++) {
+		float a   = fabsf (buffer[i]);
+		float t   = (a - knee) / width;
+		float g   = knee + width * t / (1 + fabsf (t));
+		float y   = a < g ? a : g;
+		buffer[i] = copysignf (y, buffer[i]);
+	}
+}
+
+/* ****************************************************************************
+ * Output statistics
+ *
+ * --stats measures every channel of the outputs while they are interleaved,
+ * before clipping, so the report tells how far a render went over: sample
+ * peak, true peak, RMS, DC offset and the clipped runs.  The true peak is the
+ * peak of the signal upsampled 4x by a polyphase windowed sinc, after ITU-R
+ * BS.1770.  With --stats or --soft-clip the output is interleaved one
+ * channel at a time: the channel is mixed into a scratch buffer and soft
+ * clipped there, then stored into the block by the loop that also sums up
+ * peak, RMS, DC and overs.  Only the true peak takes a pass of its own, over
+ * the scratch buffer.  All loops have independent lanes so they vectorize.
+ */
+
+#define TRUEPEAK_PHASES 4
+#define TRUEPEAK_TAPS 12 // per phase
+#define STATS_MAX_RUNS 100 // clipped runs whose position is kept
+
+static float          truepeak_coeffs[TRUEPEAK_PHASES][TRUEPEAK_TAPS];
+static pthread_once_t truepeak_once = PTHREAD_ONCE_INIT;
+
+struct channelstats {
+	float      peak, truepeak;
+	double     sum, sumsquares;
+	sf_count_t clipped; // samples
+	sf_count_t numruns;
+	sf_count_t runs[STATS_MAX_RUNS][2]; // first frame and length
+	bool       inrun;                   // the last sample was clipped
+	float      history[TRUEPEAK_TAPS - 1];
+};
+
+struct outputstats {
+	unsigned int         numchannels;
+	sf_count_t           frames;
+	float*               scratch; // history and samples of one channel
+	float*               upsampled;
+	struct channelstats* channels;
+};
+
+/* serializes the lines of --stats-file between concurrent jobs */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+truepeak_design ()
+{
+	const double centre = (TRUEPEAK_PHASES * TRUEPEAK_TAPS - 1) / 2.0;
+	for (int p = 0; p < TRUEPEAK_PHASES; p++) {
+		double sum = 0;
+		for (int k = 0; k < TRUEPEAK_TAPS; k++) {
+			/* tap k of phase p applies to the sample k frames back */
+			double n   = (TRUEPEAK_TAPS - 1 - k) * TRUEPEAK_PHASES + p;
+			double t   = (n - centre) / TRUEPEAK_PHASES;
+			double win = 0.42 - 0.5 * cos (2 * M_PI * (n + 0.5) / (TRUEPEAK_PHASES * TRUEPEAK_TAPS)) + 0.08 * cos (4 * M_PI * (n + 0.5) / (TRUEPEAK_PHASES * TRUEPEAK_TAPS));
+			truepeak_coeffs[p][k] = (t == 0 ? 1 : sin (M_PI * t) / (M_PI * t)) * win;
+			sum += truepeak_coeffs[p][k];
+		}
+		/* unity DC gain of every phase */
+		for (int k = 0; k < TRUEPEAK_TAPS; k++) {
+			truepeak_coeffs[p][k] /= sum;
+		}
+	}
+}
+
+static struct outputstats*
+outputstats_new (unsigned int numchannels, unsigned int blocksize)
+{
+	struct outputstats* st = (struct outputstats*)calloc (1, sizeof (struct outputstats));
+	if (!st) {
+		return NULL;
+	}
+	pthread_once (&truepeak_once, truepeak_design);
+	st->numchannels = numchannels;
+	st->scratch     = (float*)malloc (sizeof (float) * (TRUEPEAK_TAPS - 1 + blocksize));
+	st->upsampled   = (float*)malloc (sizeof (float) * blocksize);
+	st->channels    = (struct channelstats*)calloc (numchannels, sizeof (struct channelstats));
+	if (!st->scratch || !st->upsampled || !st->channels) {
+		free (st->scratch);
+		free (st->upsampled);
+		free (st->channels);
+		free (st);
+		return NULL;
+	}
+	return st;
+}
+
+static void
+outputstats_free (struct outputstats* st)
+{
+	if (st) {
+		free (st->scratch);
+		free (st->upsampled);
+		free (st->channels);
+		free (st);
+	}
+}
+
+/* Positions of the runs of samples beyond full scale.  Only called for blocks
+ * with clipped samples, so it may branch. */
+static void
+outputstats_runs (struct channelstats* cs, const float* x, sf_count_t numframes, sf_count_t position)
+{
+	for (sf_count_t i = 0; i < numframes; i++) {
+		bool over = x[i] > 1 || x[i] < -1;
+		if (over && !cs->inrun) {
+			if (cs->numruns < STATS_MAX_RUNS) {
+				cs->runs[cs->numruns][0] = position + i;
+				cs->runs[cs->numruns][1] = 0;
+			}
+			cs->numruns++;
+		}
+		if (over && cs->numruns <= STATS_MAX_RUNS) {
+			cs->runs[cs->numruns - 1][1]++;
+		}
+		cs->inrun = over;
+	}
+}
+
+/* Store the channel c of a block of output, in the scratch buffer, into the
+ * interleaved block, adding it up on the way.  The frames are counted by
+ * interleaveoutput_stage once all channels are in. */
+static void
+outputstats_channel (struct outputstats* st, unsigned int c, sf_count_t numframes, float* block)
+{
+	const unsigned int   numchannels = st->numchannels;
+	float*               x           = st->scratch + TRUEPEAK_TAPS - 1;
+	float*               y           = st->upsampled;
+	struct channelstats* cs          = &st->channels[c];
+	memcpy (st->scratch, cs->history, sizeof (cs->history));
+
+	float      peak[8] = { 0, 0, 0, 0, 0, 0, 0, 0 }, sum[8] = { 0, 0, 0, 0, 0, 0, 0, 0 }, squares[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	int        over[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	sf_count_t i       = 0;
+	for (; i + 8 <= numframes; i += 8) {
+		for (unsigned int q = 0; q < 8; q++) {
+			float v                          = x[i + q];
+			float a                          = fabsf (v);
+			block[(i + q) * numchannels + c] = v;
+			peak[q]                          = a > peak[q] ? a : peak[q];
+			sum[q]                          += v;
+			squares[q]                      += v * v;
+			over[q]                         += a > 1;
+		}
+	}
+	for (; i < numframes; i++) {
+		float a                    = fabsf (x[i]);
+		block[i * numchannels + c] = x[i];
+		peak[0]                    = a > peak[0] ? a : peak[0];
+		sum[0]                    += x[i];
+		squares[0]                += x[i] * x[i];
+		over[0]                   += a > 1;
+	}
+	for (unsigned int q = 0; q < 8; q++) {
+		cs->peak = peak[q] > cs->peak ? peak[q] : cs->peak;
+		cs->sum += sum[q];
+		cs->sumsquares += squares[q];
+		cs->clipped += over[q];
+	}
+
+	/* every phase as a sum of shifted, scaled copies of the input */
+	float truepeak = cs->truepeak;
+	for (unsigned int p = 0; p < TRUEPEAK_PHASES; p++) {
+		for (sf_count_t i = 0; i < numframes; i++) {
+			y[i] = 0;
+		}
+		for (unsigned int k = 0; k < TRUEPEAK_TAPS; k++) {
+			const float  coeff = truepeak_coeffs[p][k];
+			const float* src   = x - k;
+			for (sf_count_t i = 0; i < numframes; i++) {
+				y[i] += coeff * src[i];
+			}
+		}
+		float phasepeak = peak8 (y, numframes);
+		truepeak        = phasepeak > truepeak ? phasepeak : truepeak;
+	}
+	cs->truepeak = truepeak;
+
+	int clipped = 0;
+	for (unsigned int q = 0; q < 8; q++) {
+		clipped += over[q];
+	}
+	if (clipped) {
+		outputstats_runs (cs, x, numframes, st->frames);
+	} else {
+		cs->inrun = false;
+	}
+	memcpy (cs->history, x + numframes - (TRUEPEAK_TAPS - 1), sizeof (cs->history));
+}
+
+/* interleaveoutput, with the output stages that work on the samples of a
+ * channel: the soft clip and the statistics */
+static void
+interleaveoutput_stage (unsigned int offset, sf_count_t numframes, const struct outputstream* stream, float* block)
+{
+	const unsigned int  numchannels = stream->numchannels;
+	const unsigned int  numsources  = stream->numsources;
+	struct outputstats* st          = stream->stats;
+	float               local[st ? 1 : numframes];
+	float*              x = st ? st->scratch + TRUEPEAK_TAPS - 1 : local;
+	for (unsigned int channel = 0; channel < numchannels; channel++) {
+		if (stream->matrix) {
+			const float* coeffs = stream->matrix + channel * numsources;
+			for (sf_count_t i = 0; i < numframes; i++) {
+				x[i] = 0;
+			}
+			for (unsigned int source = 0; source < numsources; source++) {
+				const float* in = stream->sources[source] + offset;
+				for (sf_count_t i = 0; coeffs[source] != 0 && i < numframes; i++) {
+					x[i] += coeffs[source] * in[i];
+				}
+			}
+		} else {
+			memcpy (x, stream->sources[channel] + offset, sizeof (float) * numframes);
+		}
+		if (stream->softclip > 0) {
+			softclip (stream->softclip, numframes, x);
+		}
+		if (st) {
+			outputstats_channel (st, channel, numframes, block);
+		} else {
+			for (sf_count_t i = 0; i < numframes; i++) {
+				block[i * numchannels + channel] = x[i];
+			}
+		}
+	}
+	if (st) {
+		st->frames += numframes;
+	}
+}
+
+static double
+decibels (double x)
+{
+	return x > 0 ? 20 * log10 (x) : -INFINITY;
+}
+
+/* Print the statistics of an output to text, and as JSON lines to json */
+static void
+outputstats_report (const struct outputstats* st, const char* path, int samplerate, FILE* text, FILE* json)
+{
+	for (unsigned int c = 0; c < st->numchannels; c++) {
+		const struct channelstats* cs  = &st->channels[c];
+		double                     rms = st->frames ? sqrt (cs->sumsquares / st->frames) : 0;
+		double                     dc  = st->frames ? cs->sum / st->frames : 0;
+		if (text) {
+			fprintf (text, "Stats: %s channel %u: peak %.2f dBFS, true peak %.2f dBTP, RMS %.2f dBFS, DC %+.6f, %lld clipped samples in %lld runs", path, c + 1, decibels (cs->peak), decibels (cs->truepeak), decibels (rms), dc, (long long)cs->clipped, (long long)cs->numruns);
+			if (cs->numruns) {
+				fprintf (text, ", the first at %.3f s", (double)cs->runs[0][0] / samplerate);
+			}
+			fprintf (text, ".\n");
+		}
+		if (!json) {
+			continue;
+		}
+		pthread_mutex_lock (&stats_lock);
+		fprintf (json, "{\"file\":");
+		json_string (json, path);
+		fprintf (json, ",\"channel\":%u,\"frames\":%lld,\"samplerate\":%d,\"cpu\":", c + 1, (long long)st->frames, samplerate);
+		fprintf (json, placement_cpu >= 0 ? "%d" : "null", placement_cpu);
+		fprintf (json, ",\"node\":");
+		fprintf (json, placement_node >= 0 ? "%d" : "null", placement_node);
+		fprintf (json, ",\"peak\":%.9g,\"true_peak\":%.9g,\"rms\":%.9g,\"dc\":%.9g,\"clipped_samples\":%lld,\"clipped_runs\":%lld,\"runs\":[", cs->peak, cs->truepeak, rms, dc, (long long)cs->clipped, (long long)cs->numruns);
+		for (sf_count_t r = 0; r < cs->numruns && r < STATS_MAX_RUNS; r++) {
+			fprintf (json, "%s[%.6f,%lld]", r ? "," : "", (double)cs->runs[r][0] / samplerate, (long long)cs->runs[r][1]);
 		}
+		fprintf (json, "]}\n");
+		fflush (json);
+		pthread_mutex_unlock (&stats_lock);
 	}
-	lilv_node_free (audio_class);
-	lilv_node_free (input_class);
-	lilv_node_free (control_class);
 }
 
-/* TODO Notes:
- * - properly zero (silence pad to blocksize) buffer at EOF
- * - verify mix/interleave with replicated buffers (numplugins * numout == numchannels)
- * - (do a latency compute run, set _plugin_latency_samples)
- * - skip writing first _plugin_latency_samples to file
- * - zero-pad _plugin_latency_samples input frames and keep processing
- */
+/* Every block runs the plugins for a full blocksize, past the end of the
+ * input on silence.  Output frame N of the pipeline belongs to input frame
+ * N - latency, so the first latency frames are dropped and the input is
+ * padded until all input frames made it to the output. */
 
 /* clang-format off */
 #define DEFINE_PROCESS                                                                            \
   (unsigned int blocksize,                                                                        \
    unsigned int numchannels,                                                                      \
    unsigned int numin, unsigned int numout,                                                       \
+   unsigned int numatomin, unsigned int numatomout,                                               \
    unsigned int       numplugins,                                                                 \
-   bool               connections[numplugins][numin][numchannels],                                \
+   float              coeffs[numplugins][numin][numchannels], /* routing and trim */              \
    float              pluginbuffers[numplugins][numin][blocksize],                                \
    float              outputbuffers[numplugins][numout][blocksize],                               \
    LilvInstance*      instances[numplugins],                                                      \
-   LV2_Atom_Sequence* seq_in,                                                                     \
-   LV2_Atom_Sequence* seq_out,                                                                    \
-   SNDFILE*           insndfile,                                                                  \
-   SNDFILE*           outsndfile)                                                                 \
+   LV2_Atom_Sequence* seq_in[numplugins][numatomin],                                              \
+   const bool         midiports[numatomin],                                                       \
+   LV2_Atom_Sequence* seq_out[numplugins][numatomout],                                            \
+   const struct midifile* midi,                                                                   \
+   struct oversampler* os,                                                                        \
+   struct rateconversion* rates,                                                                  \
+   struct silenceskip* silence,                                                                   \
+   struct progress*   progress,                                                                   \
+   sf_count_t         latency,                                                                    \
+   sf_count_t         skip, /* output frames dropped after the latency */                         \
+   const float*       latencyport,                                                                \
+   unsigned int       numinputs,                                                                  \
+   struct inputstream inputs[numinputs],                                                          \
+   unsigned int        numoutputs,                                                                \
+   struct outputstream outputs[numoutputs])                                                       \
 {                                                                                                 \
-  float sndfilebuffer[numplugins * numout * blocksize];                                           \
   float buffer[numchannels * blocksize];                                                          \
+  float filebuffer[rates->in ? numchannels * blocksize : 1];                                      \
   INITIALIZE_CLIPPED ()                                                                           \
-  sf_count_t numread;                                                                             \
-  while ((numread = sf_readf_float (insndfile, buffer, blocksize))) {                             \
-    mix (buffer, numread, numchannels, numplugins, numin, connections, blocksize, pluginbuffers); \
+  const unsigned int layout   = mix_layout (numchannels, numplugins, numin, coeffs);              \
+  const double lengthscale    = rates->outputrate / rates->filerate;                              \
+  sf_count_t   totalread      = 0;                                                                \
+  sf_count_t   position       = 0; /* output frames */                                            \
+  sf_count_t   pluginposition = 0; /* frames at the plugin rate, before oversampling */           \
+  size_t       nextevent      = 0;                                                                \
+  sf_count_t   clips          = 0; /* clipped samples */                                          \
+  for (;;) {                                                                                      \
+    if (rates->in) {                                                                              \
+      while (rates->in->fifolen < resampler_needed (rates->in, blocksize)) {                      \
+        totalread += read_inputs (numinputs, inputs, filebuffer, numchannels);                    \
+        resampler_push (rates->in, filebuffer, blocksize, 1, numchannels);                        \
+      }                                                                                           \
+      resampler_pull (rates->in, buffer, blocksize, 1, numchannels);                              \
+    } else {                                                                                      \
+      totalread += read_inputs (numinputs, inputs, buffer, numchannels);                          \
+    }                                                                                             \
+    sf_count_t expected = lengthscale == 1 ? totalread : llround (totalread * lengthscale);       \
+    progress_update (progress, totalread, clips);                                                 \
+    if (position >= expected + latency) {                                                         \
+      break;                                                                                      \
+    }                                                                                             \
+    mix (layout, buffer, numchannels, numplugins, numin, coeffs, blocksize, pluginbuffers);       \
+    prepare_atom_buffers (numplugins, numatomin, numatomout, seq_in, midiports, seq_out,          \
+                          midi, &nextevent, pluginposition * os->factor, blocksize * os->factor); \
+    if (os->factor > 1) {                                                                         \
+      oversampler_up (os, numplugins, numin, blocksize, pluginbuffers);                           \
+    }                                                                                             \
     for (unsigned int plugnum = 0; plugnum < numplugins; plugnum++) {                             \
-      seq_in->atom.size  = sizeof (LV2_Atom_Sequence_Body);                                       \
-      seq_in->atom.type  = uri_to_id (NULL, LV2_ATOM__Sequence);                                  \
-      seq_out->atom.size = atom_capacity;                                                         \
-      seq_out->atom.type = uri_to_id (NULL, LV2_ATOM__Chunk);                                     \
-      lilv_instance_run (instances[plugnum], blocksize);                                          \
+      const size_t outsize = (size_t)numout * blocksize * os->factor;                            \
+      float* pluginout = os->factor > 1 ? os->out + plugnum * outsize : &outputbuffers[plugnum][0][0]; \
+      if (silence->enabled) {                                                                     \
+        silence->total += blocksize;                                                              \
+        bool quiet = peak8 (&pluginbuffers[plugnum][0][0], (size_t)numin * blocksize) <= silence->threshold; \
+        for (unsigned int port = 0; quiet && port < numatomin; port++) {                          \
+          quiet = seq_in[plugnum][port]->atom.size <= sizeof (LV2_Atom_Sequence_Body);            \
+        }                                                                                         \
+        silence->quietframes[plugnum] = quiet ? silence->quietframes[plugnum] + blocksize : 0;    \
+        if (quiet && silence->quietframes[plugnum] >= silence->hangover                           \
+            && silence->silentframes[plugnum] >= silence->hangover) {                             \
+          memset (pluginout, 0, sizeof (float) * outsize);                                        \
+          silence->skipped += blocksize;                                                          \
+          continue;                                                                               \
+        }                                                                                         \
+      }                                                                                           \
+      lilv_instance_run (instances[plugnum], blocksize * os->factor);                             \
+      if (silence->enabled) {                                                                     \
+        bool silent = peak8 (pluginout, outsize) <= silence->threshold;                           \
+        silence->silentframes[plugnum] = silent ? silence->silentframes[plugnum] + blocksize : 0; \
+      }                                                                                           \
+    }                                                                                             \
+    if (os->factor > 1) {                                                                         \
+      oversampler_down (os, numplugins, numout, blocksize, outputbuffers);                        \
     }                                                                                             \
-    interleaveoutput (numread, numplugins, numout, blocksize, outputbuffers, sndfilebuffer);      \
-    CHECK_CLIPPED ()                                                                              \
-    sf_writef_float (outsndfile, sndfilebuffer, numread);                                         \
+    if (!pluginposition) {                                                                        \
+      /* the plugin reports its latency after the first run */                                    \
+      if (latencyport) {                                                                          \
+        latency += lrint (*latencyport * rates->outputrate / (rates->pluginrate * os->factor));   \
+        /* never skip while delayed audio may still be on its way */                              \
+        if (silence->hangover < *latencyport / os->factor) {                                      \
+          silence->hangover = ceil (*latencyport / os->factor);                                   \
+        }                                                                                         \
+      }                                                                                           \
+      if (latency) {                                                                              \
+        printf ("Note: Compensating a latency of %ld frames.\n", (long)latency);                  \
+      }                                                                                           \
+    }                                                                                             \
+    pluginposition += blocksize;                                                                  \
+    sf_count_t numframes = blocksize;                                                             \
+    if (rates->out) {                                                                             \
+      resampler_push (rates->out, &outputbuffers[0][0][0], blocksize, blocksize, 1);              \
+      numframes = resampler_pull (rates->out, rates->resampled, rates->outblocksize,              \
+                                  rates->outblocksize, 1);                                        \
+    }                                                                                             \
+    for (unsigned int stream = 0; stream < numoutputs; stream++) {                                \
+      if (outputs[stream].limiter) {                                                              \
+        limiter_process (outputs[stream].limiter, numframes, rates->outblocksize);                \
+      }                                                                                           \
+    }                                                                                             \
+    sf_count_t start = position > latency + skip ? position : latency + skip;                     \
+    sf_count_t end   = position + numframes;                                                      \
+    if (end > expected + latency) {                                                               \
+      end = expected + latency;                                                                   \
+    }                                                                                             \
+    for (unsigned int stream = 0; end > start && stream < numoutputs; stream++) {                 \
+      float* block = outputstream_acquire (&outputs[stream]);                                     \
+      if (outputs[stream].stats || outputs[stream].softclip > 0) {                                \
+        interleaveoutput_stage (start - position, end - start, &outputs[stream], block);          \
+      } else {                                                                                    \
+        interleaveoutput (start - position, end - start, &outputs[stream], block);                \
+      }                                                                                           \
+      CHECK_CLIPPED (block, (end - start) * outputs[stream].numchannels)                          \
+      outputstream_commit (&outputs[stream], end - start);                                        \
+    }                                                                                             \
+    position += numframes;                                                                        \
   }                                                                                               \
 }
 /* clang-format on */
 
 #define INITIALIZE_CLIPPED()
-#define CHECK_CLIPPED()
+#define CHECK_CLIPPED(block, size)
 
 void process_no_check_clipping DEFINE_PROCESS
 
@@ -338,8 +4740,9 @@ void process_no_check_clipping DEFINE_PROCESS
 
 #undef CHECK_CLIPPED
 /* clang-format off */
-#define CHECK_CLIPPED()                                                                        \
-if(!clipped && clipOutput (numread * numout, sndfilebuffer)) {                                 \
+#define CHECK_CLIPPED(block, size)                                                              \
+clips += clipOutput (size, block);                                                             \
+if(clips && !clipped) {                                                                        \
   clipped = true;                                                                              \
   printf (                                                                                     \
       "WARNING: Clipping output.\n"                                                            \
@@ -353,22 +4756,64 @@ if(!clipped && clipOutput (numread * numout, sndfilebuffer)) {
     int
     main (int argc, char** argv)
 {
+	/* jobs of --batch and --watch share the world of the first main () */
+	bool worldlock = pool.world != NULL;
+	if (worldlock) {
+		pthread_mutex_lock (&world_lock);
+	}
+	struct progress progress = { NULL };
+
+	/* for --metrics-file */
+	struct metricswriter metricswriter;
+	bool                 metricsstarted = false;
+	bool                 isjob = false, jobdone = false;
+	int                  jobstage = METRIC_SETUP;
+	struct timespec      stagestart;
+	clock_gettime (CLOCK_MONOTONIC, &stagestart);
 	struct arg_lit* listopt     = arg_lit1 ("l", "list", "Lists all available LV2 plugins");
 	struct arg_end* listend     = arg_end (20);
 	void*           listtable[] = { listopt, listend };
 
+	/* listings from the metadata cache */
+	struct arg_str* searchopt      = arg_str0 (NULL, "search", "<query>", "List the plugins matching the words of the query, like \"reverb stereo in/out\"");
+	struct arg_lit* jsonopt        = arg_lit0 (NULL, "json", "Print the listing as JSON lines, from the metadata cache when it is up to date");
+	struct arg_lit* jsonlistopt    = arg_lit0 ("l", "list", NULL);
+	struct arg_lit* jsonnamesopt   = arg_lit0 ("n", "nameports", NULL);
+	struct arg_lit* jsonpresetsopt = arg_lit0 ("L", "list-presets", NULL);
+	struct arg_str* jsonplugin     = arg_str0 (NULL, NULL, "plugin", NULL);
+	struct arg_end* jsonend        = arg_end (20);
+	void*           catalogtable[] = { searchopt, jsonopt, jsonlistopt, jsonnamesopt, jsonpresetsopt, jsonplugin, jsonend };
+
 	bool list_presets_only = false;
 
-	if (arg_nullcheck (listtable) != 0) {
+	if (arg_nullcheck (listtable) != 0 || arg_nullcheck (catalogtable) != 0) {
 		printf ("Error: insufficient memory\n");
 		goto cleanup_listtable;
 	}
 
-	LilvWorld* lilvworld = lilv_world_new ();
+	/* served without loading the world, which is the slow part */
+	if (!arg_parse (argc, argv, catalogtable)) {
+		bool names = jsonnamesopt->count || jsonpresetsopt->count;
+		if (searchopt->count && !jsonlistopt->count && !names && !jsonplugin->count) {
+			search_plugins (searchopt->sval[0], jsonopt->count);
+			goto cleanup_listtable;
+		} else if (!searchopt->count && jsonopt->count && (jsonlistopt->count ? !names && !jsonplugin->count : names && jsonplugin->count)) {
+			list_json (jsonplugin->count ? jsonplugin->sval[0] : NULL);
+			goto cleanup_listtable;
+		}
+	}
+
+	LilvWorld* lilvworld = pool.world;
 	if (lilvworld == NULL) {
-		goto cleanup_listtable;
+		lilvworld = lilv_world_new ();
+		if (lilvworld == NULL) {
+			goto cleanup_listtable;
+		}
+		lilv_world_load_all (lilvworld);
+		urid_atom_Sequence  = uri_to_id (NULL, LV2_ATOM__Sequence);
+		urid_atom_Chunk     = uri_to_id (NULL, LV2_ATOM__Chunk);
+		urid_midi_MidiEvent = uri_to_id (NULL, LV2_MIDI__MidiEvent);
 	}
-	lilv_world_load_all (lilvworld);
 	const LilvPlugins* plugins = lilv_world_get_all_plugins (lilvworld);
 
 	if (!arg_parse (argc, argv, listtable)) {
@@ -400,36 +4845,150 @@ if(!clipped && clipOutput (numread * numout, sndfilebuffer)) {
 		list_presets_only = true;
 	}
 
-	struct arg_rex* connectargs = arg_rexn ("c", "connect", "(\\d+:(\\d+\\.)?\\w+,?)*", "<int>:<audioport>", 0, 200, REG_EXTENDED, "Connect between audio file channels and plugin input channels.");
+	struct arg_rex* connectargs = arg_rexn ("c", "connect", "((sc)?\\d+:(\\d+\\.)?\\w+,?)*", "[sc]<int>:<audioport>", 0, 200, REG_EXTENDED, "Connect between audio file channels and plugin input channels.");
 
-	struct arg_file* infile         = arg_file1 ("i", NULL, "input", "Input sound file");
-	struct arg_file* outfile        = arg_file1 ("o", NULL, "output", "Output sound file");
-	struct arg_rex*  controls       = arg_rexn ("p", "parameters", "(\\w+:\\w+,?)*", "<controlport>:<float>", 0, 200, REG_EXTENDED, "Pass a value to a plugin control port.");
+	struct arg_file* infile         = arg_filen ("i", NULL, "input", 0, MAX_INPUTS, "Input sound file, the channels of several inputs are concatenated");
+	struct arg_file* outfile        = arg_filen ("o", NULL, "output", 0, 200, "Output sound file, may contain {instance}, {port} and {excerpt}, or be given once per instance");
+	struct arg_rex*  controls       = arg_rexn ("p", "parameters", "((\\d+\\.)?\\w+:[-+.[:alnum:]_]+,?)*", "[<int>.]<controlport>:<float>", 0, 200, REG_EXTENDED, "Pass a value to a plugin control port, of every instance or only the given one.");
 	pluginname                      = arg_str1 (NULL, NULL, "plugin", "The LV2 URI of the plugin");
 	struct arg_int* blksize         = arg_int0 ("b", "blocksize", "<int>", "Chunk size in which the sound is processed. This is frames, not samples.");
 	struct arg_str* presetname      = arg_str0 ("P", "preset", "<name>", "Plugin-preset to load (before applying custom ctrl-port values)");
 	struct arg_lit* mono            = arg_lit0 ("m", "mono", "Mix all of the channels together before processing.");
 	struct arg_lit* ignore_clipping = arg_lit0 (NULL, "ignore-clipping", "Do not check for clipping.  This option is slightly faster");
+	struct arg_file* midifile       = arg_file0 (NULL, "midi", "<file>", "Standard MIDI file to send to the plugin's MIDI input(s)");
+	struct arg_int*  oversample     = arg_int0 (NULL, "oversample", "<int>", "Run the plugin at 2, 4 or 8 times the sample rate of the input");
+	struct arg_int*  pluginrateopt  = arg_int0 (NULL, "plugin-rate", "<int>", "Sample rate to run the plugin at, converting from the input");
+	struct arg_int*  outputrateopt  = arg_int0 (NULL, "output-rate", "<int>", "Sample rate of the output file(s), converting from the plugin");
+	struct arg_lit*  skipsilence    = arg_lit0 (NULL, "skip-silence", "Do not run the plugin on silent input once its output has decayed");
+	struct arg_dbl*  silencelevel   = arg_dbl0 (NULL, "silence-threshold", "<dBFS>", "Level up to which --skip-silence considers a block silent (default: digital silence)");
+	struct arg_dbl*  hangover       = arg_dbl0 (NULL, "hangover", "<seconds>", "Silence of input and output needed before --skip-silence skips the plugin (default: 2)");
+	struct arg_lit*  checksumopt    = arg_lit0 (NULL, "checksum", "Print a checksum of every output");
+	struct arg_str*  compare        = arg_strn (NULL, "compare", "<options>", 0, 2, "Render twice, with these options added, and report where the outputs differ");
+	struct arg_file* batch          = arg_file0 (NULL, "batch", "<file>", "Process every \"input output\" line of the file, reusing the plugin instances");
+	struct arg_int*  poolmemory     = arg_int0 (NULL, "pool-memory", "<MB>", "Memory that idle plugin instances may keep in --batch mode (default: 1024)");
+	struct arg_file* watch          = arg_file0 (NULL, "watch", "<dir>", "Process every file written or moved into the directory, until interrupted");
+	struct arg_file* outdir         = arg_file0 (NULL, "out-dir", "<dir>", "Directory --watch writes the outputs to");
+	struct arg_int*  workers        = arg_int0 (NULL, "workers", "<int>", "Number of files --watch processes at once (default: number of CPUs)");
+	struct arg_lit*  follow         = arg_lit0 (NULL, "follow", "Keep processing the input while it is being written, until INPUT.done exists");
+	struct arg_dbl*  idletimeout    = arg_dbl0 (NULL, "idle-timeout", "<seconds>", "Stop --follow when the input did not grow for this long (default: 10)");
+	struct arg_str*  preview        = arg_str0 (NULL, "preview", "<N>x<seconds>", "Render N excerpts spread over the input, in parallel, instead of all of it");
+	struct arg_dbl*  preroll        = arg_dbl0 (NULL, "preroll", "<seconds>", "Input rendered but not kept before every --preview excerpt (default: 2)");
+	struct arg_lit*  dryrunopt      = arg_lit0 (NULL, "dry-run", "Set the job up and estimate its time, memory and output size, without rendering it");
+	struct arg_file* progressopt    = arg_file0 (NULL, "progress", "<file>", "Keep the progress of the job in a shared memory file, like /dev/shm/job");
+	struct arg_file* metricsfile    = arg_file0 (NULL, "metrics-file", "<file>", "Write counters of all jobs to the file in the Prometheus text format");
+	struct arg_dbl*  metricsperiod  = arg_dbl0 (NULL, "metrics-interval", "<seconds>", "How often --metrics-file is written (default: 5)");
+	struct arg_lit*  statsopt       = arg_lit0 (NULL, "stats", "Print the peak, true peak, RMS, DC offset and clipping of every output channel");
+	struct arg_file* statsfile      = arg_file0 (NULL, "stats-file", "<file>", "Append the --stats of every output channel to the file as JSON lines");
+	struct arg_dbl*  limiteropt     = arg_dbl0 (NULL, "limiter", "<dBFS>", "Keep the output below the ceiling with a look-ahead limiter instead of clipping it");
+	struct arg_dbl*  lookahead      = arg_dbl0 (NULL, "lookahead", "<ms>", "Look-ahead and latency of --limiter (default: 5)");
+	struct arg_dbl*  softclipopt    = arg_dbl0 (NULL, "soft-clip", "<dBFS>", "Saturate the output smoothly up to the ceiling instead of clipping it");
+	struct arg_dbl*  prenormalize   = arg_dbl0 (NULL, "pre-normalize", "<dBFS>", "Scan the input and trim it to this peak level before processing");
+	struct arg_lit*  normalizerms   = arg_lit0 (NULL, "normalize-rms", "Trim the RMS level of the input to the --pre-normalize level instead of its peak");
+	struct arg_str*  inmatrixopt    = arg_str0 (NULL, "input-matrix", "<matrix>", "Channels the plugin sees, as rows like \"0.5,0.5;0.5,-0.5\" over the input channels, or ms");
+	struct arg_str*  outmatrixopt   = arg_str0 (NULL, "output-matrix", "<matrix>", "Channels of the output file, as rows over all plugin outputs, or ms");
+	struct arg_str*  cpusopt        = arg_str0 (NULL, "cpus", "<list>", "CPUs to run on, like 0-7,16-23, with every job thread pinned to one of them");
+	struct arg_lit*  numaopt        = arg_lit0 (NULL, "numa", "Keep every job, its threads, buffers and plugin instances on one NUMA node");
+	struct arg_file* sidechain      = arg_filen (NULL, "sidechain", "<file>", 0, MAX_INPUTS, "Additional input whose channels are connected as sc<int>:<audioport>");
 	blksize->ival[0]                = 512;
+	oversample->ival[0]             = 1;
+	hangover->dval[0]               = 2;
+	poolmemory->ival[0]             = 1024;
+	idletimeout->dval[0]            = 10;
+	metricsperiod->dval[0]          = 5;
+	preroll->dval[0]                = 2;
+	lookahead->dval[0]              = LIMITER_LOOKAHEAD;
 	struct arg_end* endarg          = arg_end (20);
-	void*           argtable[]      = { infile, outfile, presetname, controls, connectargs, blksize, mono, ignore_clipping, pluginname, endarg };
+	void*           argtable[]      = { infile, outfile, presetname, controls, connectargs, blksize, mono, ignore_clipping, midifile, sidechain, oversample, pluginrateopt, outputrateopt, skipsilence, silencelevel, hangover, checksumopt, compare, batch, poolmemory, watch, outdir, workers, follow, idletimeout, preview, preroll, dryrunopt, progressopt, metricsfile, metricsperiod, statsopt, statsfile, limiteropt, lookahead, softclipopt, prenormalize, normalizerms, inmatrixopt, outmatrixopt, cpusopt, numaopt, pluginname, endarg };
 	if (arg_nullcheck (argtable) != 0) {
 		fprintf (stderr, "Error: insufficient memory\n");
 		goto cleanup_argtable;
 	}
 	int nerrors = arg_parse (argc, argv, argtable);
+	bool service = batch->count || watch->count;
+	if (!nerrors && !list_presets_only && (service ? infile->count || outfile->count : !infile->count || !outfile->count)) {
+		fprintf (stderr, service ? "lv2file: --batch and --watch take the input and output files from elsewhere\n" : "lv2file: missing option %s\n", infile->count ? "-o <output>" : "-i <input>");
+		nerrors++;
+	} else if (!nerrors && !list_presets_only && watch->count && !outdir->count) {
+		fprintf (stderr, "lv2file: --watch needs --out-dir\n");
+		nerrors++;
+	} else if (!nerrors && !list_presets_only && preview->count && (service || follow->count || compare->count)) {
+		fprintf (stderr, "lv2file: --preview can not be combined with --batch, --watch, --follow or --compare\n");
+		nerrors++;
+	} else if (!nerrors && !list_presets_only && dryrunopt->count && (watch->count || preview->count || follow->count || compare->count)) {
+		fprintf (stderr, "lv2file: --dry-run can not be combined with --watch, --preview, --follow or --compare\n");
+		nerrors++;
+	} else if (!nerrors && !list_presets_only && progressopt->count && (watch->count || preview->count || compare->count)) {
+		fprintf (stderr, "lv2file: --progress can not be combined with --watch, --preview or --compare, whose jobs run at the same time\n");
+		nerrors++;
+	} else if (!nerrors && !list_presets_only && (!(lookahead->dval[0] > 0) || (limiteropt->count && !isfinite (limiteropt->dval[0])) || (softclipopt->count && !isfinite (softclipopt->dval[0])))) {
+		fprintf (stderr, "lv2file: --lookahead must be positive and the ceilings of --limiter and --soft-clip finite\n");
+		nerrors++;
+	} else if (!nerrors && !list_presets_only && prenormalize->count && (follow->count || !isfinite (prenormalize->dval[0]))) {
+		fprintf (stderr, "lv2file: --pre-normalize needs a finite level, and the whole input, which --follow does not have yet\n");
+		nerrors++;
+	} else if (!nerrors && !list_presets_only && normalizerms->count && !prenormalize->count) {
+		fprintf (stderr, "lv2file: --normalize-rms needs --pre-normalize\n");
+		nerrors++;
+	}
 	if (nerrors && !list_presets_only) {
 		arg_print_errors (stderr, endarg, "lv2file");
 		fprintf (stderr, "usage:\nlv2file\t");
 		arg_print_syntaxv (stderr, listtable, "\n\t");
 		arg_print_syntaxv (stderr, listpresettable, "\n\t");
 		arg_print_syntaxv (stderr, listnamestable, "\n\t");
+		arg_print_syntaxv (stderr, catalogtable, "\n\t");
 		arg_print_syntaxv (stderr, argtable, "\n");
 		arg_print_glossary_gnu (stderr, listtable);
 		arg_print_glossary_gnu (stderr, listnamestable);
+		arg_print_glossary_gnu (stderr, catalogtable);
 		arg_print_glossary_gnu (stderr, argtable);
 		goto cleanup_argtable;
 	}
+	if (compare->count) {
+		compare_renders (argc, argv, compare->count, compare->sval);
+		goto cleanup_argtable;
+	}
+	dryrun.enabled = dryrunopt->count > 0;
+	/* the jobs of --batch, --watch and --preview are placed by the first main () */
+	if ((cpusopt->count || numaopt->count) && !worldlock && !list_presets_only && !placement_init (cpusopt->count ? cpusopt->sval[0] : NULL, numaopt->count > 0)) {
+		goto cleanup_argtable;
+	}
+	/* the jobs of --batch and --watch count into the writer of the first main () */
+	if (metricsfile->count && !worldlock && !list_presets_only) {
+		metricsstarted = metrics_start (&metricswriter, metricsfile->filename[0], metricsperiod->dval[0]);
+		if (!metricsstarted) {
+			fprintf (stderr, "Error: Unable to start the metrics writer\n");
+		}
+	}
+	if (service || preview->count) {
+		pool.enabled = true;
+		pool.world   = lilvworld;
+		pool.limit   = (size_t)poolmemory->ival[0] << 20;
+		if (preview->count) {
+			run_preview (argc, argv, preview->sval[0], preroll->dval[0], infile->filename[0], outfile->count, outfile->filename);
+		} else if (batch->count) {
+			run_batch (argc, argv, batch->filename[0]);
+			if (dryrun.enabled) {
+				dryrun_total ();
+			}
+		} else {
+			long numworkers = workers->count ? workers->ival[0] : sysconf (_SC_NPROCESSORS_ONLN);
+			run_watch (argc, argv, watch->filename[0], outdir->filename[0], numworkers > 0 ? numworkers : 1);
+		}
+		pool_free ();
+		pool.enabled = false;
+		pool.world   = NULL;
+		goto cleanup_argtable;
+	}
+
+	isjob = !list_presets_only;
+	if (isjob) {
+		metrics_add (&metrics.jobs_running, 1);
+		placement_pin_job ();
+	}
+	if (progressopt->count && !list_presets_only && !progress_open (&progress, progressopt->filename[0])) {
+		goto cleanup_argtable;
+	}
 
 	bool mixdown = mono->count;
 
@@ -486,17 +5045,153 @@ if(!clipped && clipOutput (numread * numout, sndfilebuffer)) {
 		fprintf (stderr, "Preset '%s' was not found.\n", presetname->sval[0]);
 	}
 
-	SF_INFO formatinfo;
-	formatinfo.format   = 0;
-	SNDFILE* insndfile  = sf_open (*(infile->filename), SFM_READ, &formatinfo);
-	int      sndfileerr = sf_error (insndfile);
-	if (sndfileerr) {
-		fprintf (stderr, "Error reading input file: %s\n", sf_error_number (sndfileerr));
+	struct midifile    midi = { NULL, 0 };
+	struct inputstream inputs[MAX_INPUTS];
+	unsigned int       numinputs = 0;
+	float*             gains     = NULL; // of the input channels
+	float*             inmatrix  = NULL; // --input-matrix
+	float*             outmatrix = NULL; // --output-matrix
+
+	SF_INFO      formatinfo;
+	int          sndfileerr  = 0;
+	unsigned int numchannels = 0;
+	sf_count_t   inputlength = 0; // of the longest input
+	if (infile->count + sidechain->count > MAX_INPUTS) {
+		fprintf (stderr, "Error: At most %d input and sidechain files can be used.\n", MAX_INPUTS);
+		goto cleanup_sndfile;
+	}
+	for (int i = 0; i < infile->count; i++) {
+		SF_INFO ininfo;
+		ininfo.format      = 0;
+		SNDFILE* insndfile = sf_open (infile->filename[i], SFM_READ, &ininfo);
+		sndfileerr         = sf_error (insndfile);
+		if (sndfileerr) {
+			fprintf (stderr, "Error reading input file %s: %s\n", infile->filename[i], sf_error_number (sndfileerr));
+			goto cleanup_sndfile;
+		}
+		inputs[numinputs++] = (struct inputstream){ .file = insndfile, .numchannels = ininfo.channels, .offset = numchannels, .path = infile->filename[i], .follow = follow->count > 0, .idletimeout = idletimeout->dval[0] };
+		numchannels += ininfo.channels;
+		if (ininfo.frames > inputlength) {
+			inputlength = ininfo.frames;
+		}
+		if (i == 0) {
+			/* the output takes the format of the first input */
+			formatinfo = ininfo;
+		} else if (ininfo.samplerate != formatinfo.samplerate) {
+			fprintf (stderr, "Error: Input file %s has a different sample rate than %s.\n", infile->filename[i], infile->filename[0]);
+			goto cleanup_sndfile;
+		} else if (ininfo.frames != formatinfo.frames) {
+			printf ("Note: Input file %s has a different length, padding with silence.\n", infile->filename[i]);
+		}
+	}
+	if (infile->count > 1) {
+		printf ("Note: Concatenating the channels of %d input files.\n", infile->count);
+	}
+
+	unsigned int nummainchannels = numchannels;
+	unsigned int blocksize       = blksize->ival[0];
+	unsigned int factor          = oversample->ival[0];
+	if (factor != 1 && factor != 2 && factor != 4 && factor != 8) {
+		fprintf (stderr, "Error: The oversampling factor must be 1, 2, 4 or 8.\n");
+		goto cleanup_sndfile;
+	}
+	struct rateconversion rates = { formatinfo.samplerate, formatinfo.samplerate, formatinfo.samplerate, NULL, NULL, NULL, blocksize };
+	if (pluginrateopt->count) {
+		rates.pluginrate = rates.outputrate = pluginrateopt->ival[0];
+	}
+	if (outputrateopt->count) {
+		rates.outputrate = outputrateopt->ival[0];
+	}
+	if (rates.pluginrate <= 0 || rates.outputrate <= 0) {
+		fprintf (stderr, "Error: Sample rates must be positive.\n");
+		goto cleanup_sndfile;
+	}
+	/* the plugin runs at a multiple of its rate */
+	double       pluginrate      = rates.pluginrate * factor;
+	unsigned int pluginblocksize = blocksize * factor;
+
+	for (int i = 0; i < sidechain->count; i++) {
+		SF_INFO sideinfo;
+		sideinfo.format   = 0;
+		SNDFILE* sidefile = sf_open (sidechain->filename[i], SFM_READ, &sideinfo);
+		sndfileerr        = sf_error (sidefile);
+		if (sndfileerr) {
+			fprintf (stderr, "Error reading sidechain file %s: %s\n", sidechain->filename[i], sf_error_number (sndfileerr));
+			goto cleanup_sndfile;
+		}
+		inputs[numinputs++] = (struct inputstream){ .file = sidefile, .numchannels = sideinfo.channels, .offset = numchannels, .sidechain = true };
+		numchannels += sideinfo.channels;
+		if (sideinfo.samplerate != formatinfo.samplerate) {
+			fprintf (stderr, "Error: Sidechain file %s has a different sample rate than %s.\n", sidechain->filename[i], infile->filename[0]);
+			goto cleanup_sndfile;
+		}
+	}
+	unsigned int numsidechannels = numchannels - nummainchannels;
+
+	/* --pre-normalize: one trim for the channels of the main inputs, applied
+	 * by mix (); sidechains keep their level */
+	gains = (float*)malloc (sizeof (float) * (numchannels ? numchannels : 1));
+	if (!gains) {
+		fprintf (stderr, "Error: insufficient memory\n");
 		goto cleanup_sndfile;
 	}
+	for (unsigned int c = 0; c < numchannels; c++) {
+		gains[c] = 1;
+	}
+	if (prenormalize->count) {
+		double     peak = 0, sumsquares = 0;
+		sf_count_t numsamples = 0;
+		bool       fromheader = true;
+		for (unsigned int i = 0; i < numinputs; i++) {
+			if (!inputs[i].sidechain && !inputstream_scan (&inputs[i], normalizerms->count > 0, &peak, &sumsquares, &numsamples, &fromheader)) {
+				fprintf (stderr, "Error: Unable to scan the input file %s for --pre-normalize\n", inputs[i].path);
+				goto cleanup_sndfile;
+			}
+		}
+		double level = normalizerms->count ? (numsamples ? sqrt (sumsquares / numsamples) : 0) : peak;
+		if (level > 0) {
+			double trim = pow (10, prenormalize->dval[0] / 20) / level;
+			for (unsigned int c = 0; c < nummainchannels; c++) {
+				gains[c] = trim;
+			}
+			printf ("Note: Trimming the input by %+.2f dB, its %s is %.2f dBFS%s.\n", 20 * log10 (trim), normalizerms->count ? "RMS level" : "peak", 20 * log10 (level), fromheader ? " according to its PEAK chunk" : "");
+		} else {
+			printf ("Note: The input is silent, not trimming it.\n");
+		}
+	}
 
-	unsigned int numchannels = formatinfo.channels;
-	unsigned int blocksize   = blksize->ival[0];
+	/* --input-matrix: the rows of the matrix take the place of the channels
+	 * of the main inputs for the routing */
+	unsigned int numfilechannels = nummainchannels;
+	if (inmatrixopt->count) {
+		if (!(inmatrix = parse_matrix (inmatrixopt->sval[0], ms_encode, numfilechannels, &nummainchannels))) {
+			goto cleanup_sndfile;
+		}
+		printf ("Note: Matrixing %u input channels to %u.\n", numfilechannels, nummainchannels);
+	}
+	unsigned int numrouted = nummainchannels + numsidechannels;
+
+	/* a --preview excerpt starts with its pre-roll */
+	sf_count_t excerptoffset = current_excerpt ? current_excerpt->start - current_excerpt->preroll : 0;
+	for (unsigned int i = 0; current_excerpt && i < numinputs; i++) {
+		inputs[i].limited = true;
+		inputs[i].limit   = sf_seek (inputs[i].file, excerptoffset, SEEK_SET) < 0 ? 0 : current_excerpt->preroll + current_excerpt->length;
+	}
+
+	if (midifile->count && !load_midi_file (midifile->filename[0], pluginrate, &midi)) {
+		goto cleanup_sndfile;
+	}
+	if (excerptoffset && midi.numevents) {
+		sf_count_t offset = llround (excerptoffset * pluginrate / formatinfo.samplerate);
+		size_t     kept   = 0;
+		for (size_t i = 0; i < midi.numevents; i++) {
+			if (midi.events[i].frame >= offset) {
+				midi.events[kept]         = midi.events[i];
+				midi.events[kept++].frame = midi.events[i].frame - offset;
+			}
+		}
+		midi.numevents = kept;
+	}
 
 	{
 		uint32_t     numports = lilv_plugin_get_num_ports (plugin);
@@ -508,9 +5203,15 @@ if(!clipped && clipOutput (numread * numout, sndfilebuffer)) {
 		uint32_t     controlindices[numports];
 		unsigned int numcontrolout = 0;
 		uint32_t     controloutindices[numports];
+		unsigned int numatomin = 0;
+		uint32_t     atominindices[numports];
+		bool         midiports[numports];
+		unsigned int numatomout = 0;
+		uint32_t     atomoutindices[numports];
 
-		bool portsproblem  = false;
-		int  fwheelportidx = -1;
+		bool portsproblem   = false;
+		int  fwheelportidx  = -1;
+		int  latencyportidx = -1;
 		for (uint32_t i = 0; i < numports; i++) {
 			const LilvPort* porti = lilv_plugin_get_port_by_index (plugin, i);
 			if (lilv_port_is_a (plugin, porti, audio_class)) {
@@ -525,13 +5226,13 @@ if(!clipped && clipOutput (numread * numout, sndfilebuffer)) {
 			} else if (lilv_port_is_a (plugin, porti, control_class)) {
 				//We really only care about *input* control ports.
 				if (lilv_port_is_a (plugin, porti, input_class)) {
-					controlindices[numcontrol++] = i;
 					if (lilv_port_has_property (plugin, porti, freewheel_port)) {
-						fwheelportidx = i;
+						fwheelportidx = numcontrol;
 					}
+					controlindices[numcontrol++] = i;
 				} else if (lilv_port_is_a (plugin, porti, output_class)) {
 					if (lilv_port_has_property (plugin, porti, latency_port)) {
-						// TODO: remember this port, use its value later (ignore first N output samples)
+						latencyportidx = numcontrolout;
 					}
 					controloutindices[numcontrolout++] = i;
 				} else {
@@ -539,7 +5240,12 @@ if(!clipped && clipOutput (numread * numout, sndfilebuffer)) {
 					portsproblem = true;
 				}
 			} else if (lilv_port_is_a (plugin, porti, atom_AtomPort)) {
-				/* OK, handled later */
+				if (lilv_port_is_a (plugin, porti, input_class)) {
+					midiports[numatomin]       = lilv_port_supports_event (plugin, porti, midi_class);
+					atominindices[numatomin++] = i;
+				} else {
+					atomoutindices[numatomout++] = i;
+				}
 			} else if (!lilv_port_has_property (plugin, porti, optional)) {
 				fprintf (stderr, "Error!  Unable to handle a required port \n");
 				portsproblem = true;
@@ -549,115 +5255,129 @@ if(!clipped && clipOutput (numread * numout, sndfilebuffer)) {
 		if (portsproblem) {
 			goto cleanup_sndfile;
 		}
-		formatinfo.channels = numout;
-		SNDFILE* outsndfile = sf_open (*(outfile->filename), SFM_WRITE, &formatinfo);
-
-		sndfileerr = sf_error (outsndfile);
-		if (sndfileerr) {
-			fprintf (stderr, "Error reading output file: %s\n", sf_error_number (sndfileerr));
-			goto cleanup_outfile;
+		if (midi.numevents && !popcount (midiports, numatomin)) {
+			fprintf (stderr, "WARNING: The plugin has no MIDI input, ignoring the MIDI file.\n");
 		}
+		struct outputstream* outputs    = NULL;
+		unsigned int         numoutputs = 0;
 
 		{
-			unsigned int numplugins = 1;
-			if (connectargs->count) {
-				for (int i = 0; i < connectargs->count; i++) {
-					const char* connectionlist = connectargs->sval[i];
-					while (*connectionlist) {
-						char* nextcomma = strchr (connectionlist, ',');
-						char* nextcolon;
-						if (nextcomma) {
-							nextcolon = memchr (connectionlist, ':', nextcomma - connectionlist);
-						} else {
-							nextcolon = strchr (connectionlist, ':');
-						}
-						if (!nextcolon) {
-							fprintf (stderr, "Error parsing connection:  Expected colon between channel and port.\n");
+			unsigned int numplugins     = 1;
+			unsigned int numconnections = 0;
+			for (int i = 0; i < connectargs->count; i++) {
+				numconnections++;
+				for (const char* c = connectargs->sval[i]; *c; c++) {
+					numconnections += *c == ',';
+				}
+			}
+			struct connection connectionlist[numconnections + 1];
+			numconnections = 0;
+			for (int i = 0; i < connectargs->count; i++) {
+				char* text = (char*)connectargs->sval[i];
+				while (text) {
+					char* nextcomma = strchr (text, ',');
+					if (nextcomma) {
+						*nextcomma = 0;
+					}
+					if (*text) {
+						struct connection* conn = &connectionlist[numconnections++];
+						if (!parse_connection (text, nummainchannels, numsidechannels, conn)) {
 							goto cleanup_outfile;
 						}
-						nextcolon++;
-						int   pluginstance = 0;
-						char* nextperiod   = strchr (nextcolon, '.');
-						if (nextperiod) {
-							char tmpbuffer[nextperiod - nextcolon + 1];
-							memcpy (tmpbuffer, nextcolon, sizeof (char) * (nextperiod - nextcolon));
-							tmpbuffer[nextperiod - nextcolon] = 0;
-							pluginstance                      = atoi (tmpbuffer) - 1;
-							if (pluginstance < 0) {
-								fprintf (stderr, "Invalid plugin instance specified");
-								goto cleanup_outfile;
-							}
-						} else {
-							nextperiod = nextcolon;
-						}
-						if (((unsigned)pluginstance) >= numplugins) {
+						if (conn->instance >= numplugins) {
 							//Make sure we are instantiating enough instances of the plugin.
-							numplugins = pluginstance + 1;
-						}
-						if (nextcomma) {
-							connectionlist = nextcomma + 1;
-						} else {
-							break;
+							numplugins = conn->instance + 1;
 						}
 					}
+					text = nextcomma ? nextcomma + 1 : NULL;
 				}
-			} else if (numin == 1 && !mixdown) {
-				numplugins = numchannels;
+			}
+			if (!connectargs->count && numin == 1 && !mixdown) {
+				numplugins = nummainchannels;
 			}
 			printf ("Note: Running %i instances of the plugin.\n", numplugins);
-			bool connections[numplugins][numin][numchannels];
+
+			/* split the plugin outputs into files */
+			const char* outtemplate = outfile->filename[0];
+			bool        perport     = strstr (outtemplate, "{port}") != NULL;
+			bool        perinstance = perport || strstr (outtemplate, "{instance}") || outfile->count > 1;
+			if (outfile->count > 1 && (unsigned)outfile->count != numplugins) {
+				fprintf (stderr, "Error: %d output files given for %u instances of the plugin.\n", outfile->count, numplugins);
+				goto cleanup_outfile;
+			}
+			/* --output-matrix mixes all plugin outputs into the channels of one file */
+			unsigned int numsources = numplugins * numout, numrows = 0;
+			if (outmatrixopt->count && perinstance) {
+				fprintf (stderr, "Error: --output-matrix writes a single output file, without {instance} or {port}.\n");
+				goto cleanup_outfile;
+			}
+			if (outmatrixopt->count && !(outmatrix = parse_matrix (outmatrixopt->sval[0], ms_decode, numsources, &numrows))) {
+				goto cleanup_outfile;
+			}
+			outputs = (struct outputstream*)calloc (numplugins * (numout ? numout : 1), sizeof (struct outputstream));
+			if (!outputs) {
+				fprintf (stderr, "Error: insufficient memory\n");
+				goto cleanup_outfile;
+			}
+			for (unsigned int i = 0; i < (perinstance ? numplugins : 1); i++) {
+				for (unsigned int port = 0; port < (perport ? numout : 1); port++) {
+					const char* symbol = perport ? lilv_node_as_string (lilv_port_get_symbol (plugin, lilv_plugin_get_port_by_index (plugin, outindices[port]))) : NULL;
+					char*       path;
+					unsigned int excerpt = current_excerpt ? current_excerpt->number : 0;
+					if (outfile->count > 1) {
+						path = expand_output_template (outfile->filename[i], i + 1, NULL, excerpt);
+					} else {
+						path = expand_output_template (outtemplate, i + 1, symbol, excerpt);
+					}
+					unsigned int channels = perport ? 1 : (perinstance ? numout : numplugins * numout);
+					if (outmatrix) {
+						channels = numrows;
+					}
+					SF_INFO outinfo    = formatinfo;
+					outinfo.samplerate = rates.outputrate;
+					if (!outputstream_open (&outputs[numoutputs++], path, outinfo, channels, outmatrix ? numsources : channels)) {
+						goto cleanup_outfile;
+					}
+					outputs[numoutputs - 1].matrix = outmatrix;
+					if (follow->count && outputs[numoutputs - 1].file) {
+						/* keep the headers valid for readers of the growing output */
+						sf_command (outputs[numoutputs - 1].file, SFC_SET_UPDATE_HEADER_AUTO, NULL, SF_TRUE);
+						outputs[numoutputs - 1].sync = true;
+					}
+					if ((checksumopt->count || compare_sink.fd >= 0) && !checksum_init (&outputs[numoutputs - 1].checksum, channels, compare_sink.capture)) {
+						fprintf (stderr, "Error: insufficient memory\n");
+						goto cleanup_outfile;
+					}
+				}
+			}
+			if (numoutputs > 1) {
+				printf ("Note: Writing %u output files.\n", numoutputs);
+			}
+			bool connections[numplugins][numin][numrouted];
 			memset (connections, 0, sizeof (connections));
 
-			LilvInstance* instances[numplugins];
+			LilvInstance*          instances[numplugins];
+			struct hostedinstance* hosted[numplugins];
 			if (connectargs->count) {
-				for (int i = 0; i < connectargs->count; i++) {
-					const char* connectionlist = connectargs->sval[i];
-					while (*connectionlist) {
-						int channel = atoi (connectionlist) - 1;
-						if (channel < 0 || ((unsigned)channel) >= numchannels) {
-							fprintf (stderr, "Input sound file does not have channel %u.  It has %u channels.\n", channel + 1, numchannels);
-							goto cleanup_outfile;
-						}
-
-						char* nextcomma = strchr (connectionlist, ',');
-						if (nextcomma) {
-							*nextcomma = 0;
-						}
-						char* nextcolon = strchr (connectionlist, ':');
-						//Will not be nill otherwise it would have been caught when counting plugin instances
-						*nextcolon = 0;
-						nextcolon++;
-						unsigned int pluginstance = 0;
-						char*        nextperiod   = strchr (nextcolon, '.');
-						if (nextperiod) {
-							*nextperiod  = 0;
-							pluginstance = atoi (nextcolon + 1) - 1;
-						} else {
-							nextperiod = nextcolon;
-						}
-						bool foundmatch = false;
-						for (uint32_t port = 0; port < numin; port++) {
-							//Do not need to free, kept internally.
-							const char* symbol = lilv_node_as_string (lilv_port_get_symbol (plugin, lilv_plugin_get_port_by_index (plugin, inindices[port])));
-							if (!strcmp (symbol, nextperiod)) {
-								connections[pluginstance][port][channel] = true;
-								foundmatch                               = true;
-								break;
-							}
-						}
-						if (!foundmatch) {
-							fprintf (stderr, "Port with symbol %s does not exist.\n", nextcolon);
-						}
-						if (nextcomma) {
-							connectionlist = nextcomma + 1;
-						} else {
+				for (unsigned int i = 0; i < numconnections; i++) {
+					const struct connection* conn       = &connectionlist[i];
+					bool                     foundmatch = false;
+					for (uint32_t port = 0; port < numin; port++) {
+						//Do not need to free, kept internally.
+						const char* symbol = lilv_node_as_string (lilv_port_get_symbol (plugin, lilv_plugin_get_port_by_index (plugin, inindices[port])));
+						if (!strcmp (symbol, conn->port)) {
+							connections[conn->instance][port][conn->channel] = true;
+							foundmatch                                       = true;
 							break;
 						}
 					}
+					if (!foundmatch) {
+						fprintf (stderr, "Port with symbol %s does not exist.\n", conn->port);
+					}
 				}
 				printf ("Note: Only making user specified connections.\n");
 			} else {
-				if (numin == numchannels) {
+				if (numin == nummainchannels) {
 					printf ("Note: Mapping audio channels to plugin ports based on ordering\n");
 					for (unsigned int i = 0; i < numin; i++) {
 						connections[0][i][i] = true;
@@ -665,16 +5385,16 @@ if(!clipped && clipOutput (numread * numout, sndfilebuffer)) {
 				} else if (numin == 1) {
 					if (mixdown) {
 						printf ("Note: Down mixing all channels to a single plugin input\n");
-						for (unsigned int i = 0; i < numin; i++) {
+						for (unsigned int i = 0; i < nummainchannels; i++) {
 							connections[0][0][i] = true;
 						}
 					} else {
 						printf ("Note: Running an instance of the plugin per channel\n");
-						for (unsigned int i = 0; i < numchannels; i++) {
+						for (unsigned int i = 0; i < nummainchannels; i++) {
 							connections[i][0][i] = true;
 						}
 					}
-				} else if (numchannels > numin) {
+				} else if (nummainchannels > numin) {
 					printf ("Note: Extra channels ignored when mapping channels to plugin ports\n");
 					for (unsigned int i = 0; i < numin; i++) {
 						connections[0][i][i] = true;
@@ -685,73 +5405,77 @@ if(!clipped && clipOutput (numread * numout, sndfilebuffer)) {
 				}
 			}
 
+			/* the average of the connected channels, --input-matrix and
+			 * --pre-normalize folded into one coefficient per input channel */
+			float coeffs[numplugins][numin][numchannels];
+			memset (coeffs, 0, sizeof (coeffs));
+			for (unsigned int plugnum = 0; plugnum < numplugins; plugnum++) {
+				for (unsigned int port = 0; port < numin; port++) {
+					unsigned int nummixed = popcount (connections[plugnum][port], numrouted);
+					for (unsigned int routed = 0; routed < numrouted; routed++) {
+						if (!connections[plugnum][port][routed]) {
+							continue;
+						}
+						if (routed >= nummainchannels) {
+							unsigned int channel = numfilechannels + routed - nummainchannels;
+							coeffs[plugnum][port][channel] += gains[channel] / nummixed;
+							continue;
+						}
+						for (unsigned int channel = 0; channel < numfilechannels; channel++) {
+							float weight = inmatrix ? inmatrix[routed * numfilechannels + channel] : channel == routed;
+							coeffs[plugnum][port][channel] += weight * gains[channel] / nummixed;
+						}
+					}
+				}
+			}
+
 			float defaultvalues[numports];
 
 			float minvalues[numports];
 			float maxvalues[numports];
 			lilv_plugin_get_port_ranges_float (plugin, minvalues, maxvalues, defaultvalues);
 
-			struct statehelper sh = { plugin, numports, defaultvalues };
+			struct statehelper sh;
+			if (!statehelper_init (&sh, plugin, numports, defaultvalues)) {
+				fprintf (stderr, "Error: insufficient memory\n");
+				goto cleanup_outfile;
+			}
+			if (state) {
+				lilv_state_emit_port_values (state, set_port_value, &sh);
+			}
+			free (sh.symbols);
 
 			bool has_worker = lilv_plugin_has_feature (plugin, worker_schedule) && lilv_plugin_has_extension_data (plugin, worker_iface_uri);
 
-			LV2_URID           atom_Int  = uri_to_id (NULL, LV2_ATOM__Int);
-			LV2_Options_Option options[] = {
-				{ LV2_OPTIONS_INSTANCE, 0, uri_to_id (NULL, LV2_BUF_SIZE__minBlockLength),
-				  sizeof (int32_t), atom_Int, &blocksize },
-				{ LV2_OPTIONS_INSTANCE, 0, uri_to_id (NULL, LV2_BUF_SIZE__maxBlockLength),
-				  sizeof (int32_t), atom_Int, &blocksize },
-				{ LV2_OPTIONS_INSTANCE, 0, uri_to_id (NULL, LV2_BUF_SIZE__sequenceSize),
-				  sizeof (int32_t), atom_Int, &atom_capacity },
-				{ LV2_OPTIONS_INSTANCE, 0, uri_to_id (NULL, "http://lv2plug.in/ns/ext/buf-size#nominalBlockLength"),
-				  sizeof (int32_t), atom_Int, &blocksize },
-				{ LV2_OPTIONS_INSTANCE, 0, 0, 0, 0, NULL }
-			};
-
-			LV2_URID_Map      uri_map         = { NULL, &uri_to_id };
-			const LV2_Feature map_feature     = { LV2_URID__map, &uri_map };
-			const LV2_Feature unmap_feature   = { LV2_URID__unmap, NULL };
-			const LV2_Feature options_feature = { LV2_OPTIONS__options, options };
-
+			struct timespec startup;
+			clock_gettime (CLOCK_MONOTONIC, &startup);
+			const LV2_Feature* const* features[numplugins];
 			for (unsigned int i = 0; i < numplugins; i++) {
-				int                n_features = 3;
-				const LV2_Feature* features[5];
-				features[0] = &map_feature;
-				features[1] = &unmap_feature;
-				features[2] = &options_feature;
-
-				LV2_Worker_Schedule* schedule = NULL;
-				if (has_worker) {
-					schedule                = (LV2_Worker_Schedule*)malloc (sizeof (LV2_Worker_Schedule));
-					schedule->handle        = NULL;
-					schedule->schedule_work = lv2_worker_schedule;
+				hosted[i] = pool_acquire (plugin, pluginrate, pluginblocksize, has_worker);
 
-					const LV2_Feature schedule_feature = { LV2_WORKER__schedule, schedule };
-					features[n_features++]             = &schedule_feature;
-				}
-
-				features[n_features] = NULL;
-
-				instances[i] = lilv_plugin_instantiate (plugin, formatinfo.samplerate, features);
-
-				if (!instances[i]) {
+				if (!hosted[i]) {
 					fprintf (stderr, "Failed to instantiate plugin!\n");
+					for (unsigned int j = 0; j < i; j++) {
+						pool_release (hosted[j]);
+					}
 					goto cleanup_outfile;
 				}
-
-				if (has_worker) {
-					worker_iface = (LV2_Worker_Interface*)lilv_instance_get_extension_data (instances[i], LV2_WORKER__interface);
-					// XXX store handle + iface per instance ?!
-					schedule->handle = instances[i]->lv2_handle;
-				}
-
-				if (state) {
-					lilv_state_restore (state, instances[i], set_port_value, &sh, 0, NULL);
-				}
-
+				instances[i] = hosted[i]->instance;
+				features[i]  = hosted[i]->features;
+			}
+			double instantiating = elapsed_ms (&startup);
+			if (state && lilv_state_get_num_properties (state)) {
+				restore_state (state, numplugins, instances, features);
+			}
+			double restoring = elapsed_ms (&startup) - instantiating;
+			for (unsigned int i = 0; i < numplugins; i++) {
 				lilv_instance_activate (instances[i]);
+				hosted[i]->active = true;
 			}
 			lilv_state_free (state);
+			state = NULL;
+			double startuptime = elapsed_ms (&startup);
+			printf ("Note: Startup took %.1f ms: instantiating %.1f ms, restoring the preset %.1f ms, activating %.1f ms.\n", startuptime, instantiating, restoring, startuptime - instantiating - restoring);
 
 			{
 				float pluginbuffers[numplugins][numin][blocksize];
@@ -759,9 +5483,18 @@ if(!clipped && clipOutput (numread * numout, sndfilebuffer)) {
 				float outputbuffers[numplugins][numout][blocksize];
 				memset (outputbuffers, 0, sizeof (outputbuffers));
 
-				float controlports[numcontrol];
-				memset (controlports, 0, sizeof (controlports));
-				float controloutports[numcontrolout];
+				/* every instance has its own rows of control inputs and outputs, on
+				 * their own cache lines, the outputs after all the inputs */
+				const size_t controlstride    = (numcontrol + 15) & ~(size_t)15;
+				const size_t controloutstride = (numcontrolout + 15) & ~(size_t)15;
+				const size_t controlsize      = (controlstride + controloutstride) * numplugins;
+				float*       controlports     = NULL;
+				if (posix_memalign ((void**)&controlports, 64, sizeof (float) * (controlsize ? controlsize : 16))) {
+					fprintf (stderr, "Error: insufficient memory\n");
+					goto cleanup_instances;
+				}
+				float* controloutports = controlports + controlstride * numplugins;
+				memset (controloutports, 0, sizeof (float) * controloutstride * numplugins);
 
 				for (unsigned int port = 0; port < numcontrol; port++) {
 					unsigned int portindex = controlindices[port];
@@ -771,102 +5504,329 @@ if(!clipped && clipOutput (numread * numout, sndfilebuffer)) {
 				if (fwheelportidx >= 0) {
 					controlports[fwheelportidx] = 1;
 				}
+				for (unsigned int i = 1; i < numplugins; i++) {
+					memcpy (&controlports[i * controlstride], controlports, sizeof (float) * numcontrol);
+				}
 
-				if (controls->count) {
-					for (int i = 0; i < controls->count; i++) {
-						const char* parameters = controls->sval[i];
-						while (*parameters) {
-							char* nextcomma = strchr (parameters, ',');
-							if (nextcomma) {
-								*nextcomma = 0;
-							}
-							char* nextcolon = strchr (parameters, ':');
-							if (nextcolon) {
-								*nextcolon = 0;
-							} else {
-								fprintf (stderr, "Error parsing parameters:  Expected colon between port and value.\n");
-								goto cleanup_outfile;
+				for (int i = 0; i < controls->count; i++) {
+					char* text = strdup (controls->sval[i]);
+					for (char* parameters = strtok (text, ","); parameters; parameters = strtok (NULL, ",")) {
+						char* nextcolon = strchr (parameters, ':');
+						if (!nextcolon) {
+							fprintf (stderr, "Error parsing parameters:  Expected colon between port and value.\n");
+							free (text);
+							free (controlports);
+							goto cleanup_instances;
+						}
+						*nextcolon++ = 0;
+						float value  = strtof (nextcolon, NULL);
+
+						/* "INSTANCE.PORT" sets the value of one instance only */
+						unsigned int first = 0, last = numplugins;
+						char*        period = strchr (parameters, '.');
+						if (period) {
+							int instance = atoi (parameters) - 1;
+							if (instance < 0 || (unsigned)instance >= numplugins) {
+								fprintf (stderr, "WARNING: There is no instance %s of the plugin, it runs %u.\n", parameters, numplugins);
+								continue;
 							}
-							nextcolon++;
-							float value      = strtof (nextcolon, NULL);
-							bool  foundmatch = false;
-							for (uint32_t port = 0; port < numcontrol; port++) {
-								//Do not need to free, kept internally.
-								const char* symbol = lilv_node_as_string (lilv_port_get_symbol (plugin, lilv_plugin_get_port_by_index (plugin, controlindices[port])));
-								if (!strcmp (symbol, parameters)) {
-									controlports[port] = value;
-									foundmatch         = true;
-									break;
+							first      = instance;
+							last       = instance + 1;
+							parameters = period + 1;
+						}
+						bool foundmatch = false;
+						for (uint32_t port = 0; port < numcontrol; port++) {
+							//Do not need to free, kept internally.
+							const char* symbol = lilv_node_as_string (lilv_port_get_symbol (plugin, lilv_plugin_get_port_by_index (plugin, controlindices[port])));
+							if (!strcmp (symbol, parameters)) {
+								for (unsigned int instance = first; instance < last; instance++) {
+									controlports[instance * controlstride + port] = value;
 								}
-							}
-							if (!foundmatch) {
-								fprintf (stderr, "WARNING: Port with symbol %s does not exist.\n", parameters);
-							}
-							if (nextcomma) {
-								parameters = nextcomma + 1;
-							} else {
+								foundmatch = true;
 								break;
 							}
 						}
+						if (!foundmatch) {
+							fprintf (stderr, "WARNING: Port with symbol %s does not exist.\n", parameters);
+						}
+					}
+					free (text);
+				}
+
+				/* one aligned atom buffer per instance and atom port */
+				const size_t       atomstride = (sizeof (LV2_Atom_Sequence) + atom_capacity + 63) & ~(size_t)63;
+				uint8_t*           atombuffers = NULL;
+				LV2_Atom_Sequence* seq_in[numplugins][numatomin];
+				LV2_Atom_Sequence* seq_out[numplugins][numatomout];
+				if (numatomin + numatomout) {
+					if (posix_memalign ((void**)&atombuffers, 64, atomstride * numplugins * (numatomin + numatomout))) {
+						fprintf (stderr, "Error: insufficient memory\n");
+						free (controlports);
+						goto cleanup_instances;
+					}
+				}
+				for (unsigned int i = 0; i < numplugins; i++) {
+					uint8_t* base = atombuffers + atomstride * i * (numatomin + numatomout);
+					for (unsigned int port = 0; port < numatomin; port++) {
+						seq_in[i][port]            = (LV2_Atom_Sequence*)(base + atomstride * port);
+						seq_in[i][port]->atom.size = sizeof (LV2_Atom_Sequence_Body);
+						seq_in[i][port]->atom.type = urid_atom_Sequence;
+						seq_in[i][port]->body.unit = 0;
+						seq_in[i][port]->body.pad  = 0;
 					}
+					for (unsigned int port = 0; port < numatomout; port++) {
+						seq_out[i][port] = (LV2_Atom_Sequence*)(base + atomstride * (numatomin + port));
+					}
+				}
+
+				sf_count_t         quietframes[numplugins];
+				sf_count_t         silentframes[numplugins];
+				struct silenceskip silence = { skipsilence->count > 0, 0, llround (hangover->dval[0] * rates.pluginrate), quietframes, silentframes, 0, 0 };
+				if (silencelevel->count) {
+					silence.threshold = pow (10, silencelevel->dval[0] / 20);
 				}
+				memset (quietframes, 0, sizeof (quietframes));
+				memset (silentframes, 0, sizeof (silentframes));
 
-				LV2_Atom_Sequence seq_in = {
-					{ sizeof (LV2_Atom_Sequence_Body),
-					  uri_to_id (NULL, LV2_ATOM__Sequence) },
-					{ 0, 0 }
-				};
+				struct oversampler os;
+				if (!oversampler_init (&os, factor, numplugins, numin, numout, blocksize)) {
+					fprintf (stderr, "Error: insufficient memory\n");
+					oversampler_free (&os);
+					free (atombuffers);
+					free (controlports);
+					goto cleanup_instances;
+				}
+				if (factor > 1) {
+					printf ("Note: Oversampling %ux, running the plugin at %.0f Hz.\n", factor, pluginrate);
+				}
 
-				LV2_Atom_Sequence* seq_out = (LV2_Atom_Sequence*)malloc (sizeof (LV2_Atom_Sequence) + atom_capacity);
+				struct resampler srcin = { 0 }, srcout = { 0 };
+				bool             rateproblem = false;
+				if (rates.pluginrate != rates.filerate) {
+					printf ("Note: Converting the input from %.0f Hz to %.0f Hz.\n", rates.filerate, rates.pluginrate);
+					rates.in    = &srcin;
+					rateproblem = !resampler_init (&srcin, rates.filerate, rates.pluginrate, numchannels, blocksize, blocksize);
+				}
+				if (rates.outputrate != rates.pluginrate) {
+					printf ("Note: Converting the output from %.0f Hz to %.0f Hz.\n", rates.pluginrate, rates.outputrate);
+					rates.out          = &srcout;
+					rates.outblocksize = ceil ((blocksize + 2) * rates.outputrate / rates.pluginrate) + 2;
+					rates.resampled    = (float*)malloc (sizeof (float) * numplugins * numout * rates.outblocksize + 1);
+					rateproblem |= !rates.resampled || !resampler_init (&srcout, rates.pluginrate, rates.outputrate, numplugins * numout, blocksize, rates.outblocksize);
+				}
+				if (rateproblem) {
+					fprintf (stderr, "Error: insufficient memory\n");
+					goto cleanup_rates;
+				}
 
 				for (unsigned int i = 0; i < numplugins; i++) {
 					for (unsigned int port = 0; port < numin; port++) {
-						lilv_instance_connect_port (instances[i], inindices[port], pluginbuffers[i][port]);
+						float* buffer = factor > 1 ? os.in + (i * numin + port) * pluginblocksize : pluginbuffers[i][port];
+						lilv_instance_connect_port (instances[i], inindices[port], buffer);
 					}
 					for (unsigned int port = 0; port < numout; port++) {
-						lilv_instance_connect_port (instances[i], outindices[port], outputbuffers[i][port]);
+						float* buffer = factor > 1 ? os.out + (i * numout + port) * pluginblocksize : outputbuffers[i][port];
+						lilv_instance_connect_port (instances[i], outindices[port], buffer);
 					}
 					for (unsigned int port = 0; port < numcontrol; port++) {
-						lilv_instance_connect_port (instances[i], controlindices[port], &controlports[port]);
+						lilv_instance_connect_port (instances[i], controlindices[port], &controlports[i * controlstride + port]);
 					}
 					for (unsigned int port = 0; port < numcontrolout; port++) {
-						lilv_instance_connect_port (instances[i], controloutindices[port], &controloutports[port]);
+						lilv_instance_connect_port (instances[i], controloutindices[port], &controloutports[i * controloutstride + port]);
 					}
-
-					for (uint32_t j = 0; j < numports; j++) {
-						const LilvPort* porti = lilv_plugin_get_port_by_index (plugin, j);
-						if (lilv_port_is_a (plugin, porti, atom_AtomPort)) {
-							if (lilv_port_is_a (plugin, porti, input_class)) {
-								lilv_instance_connect_port (instances[i], j, &seq_in);
-							} else {
-								lilv_instance_connect_port (instances[i], j, seq_out);
-							}
+					for (unsigned int port = 0; port < numatomin; port++) {
+						lilv_instance_connect_port (instances[i], atominindices[port], seq_in[i][port]);
+					}
+					for (unsigned int port = 0; port < numatomout; port++) {
+						lilv_instance_connect_port (instances[i], atomoutindices[port], seq_out[i][port]);
+					}
+				}
+				/* files are filled instance by instance, port by port */
+				for (unsigned int stream = 0, channel = 0; stream < numoutputs; stream++) {
+					for (unsigned int c = 0; c < outputs[stream].numsources; c++, channel++) {
+						if (rates.out) {
+							outputs[stream].sources[c] = rates.resampled + (size_t)channel * rates.outblocksize;
+						} else {
+							outputs[stream].sources[c] = outputbuffers[channel / numout][channel % numout];
 						}
 					}
 				}
-				if (ignore_clipping->count) {
-					process_no_check_clipping (blocksize, numchannels, numin, numout, numplugins, connections, pluginbuffers, outputbuffers, instances, &seq_in, seq_out, insndfile, outsndfile);
+
+				for (unsigned int stream = 0; limiteropt->count && stream < numoutputs; stream++) {
+					outputs[stream].limiter = limiter_new (outputs[stream].numsources, outputs[stream].sources, outputs[stream].matrix, outputs[stream].numchannels, pow (10, limiteropt->dval[0] / 20), lookahead->dval[0] / 1000, rates.outputrate, rates.outblocksize);
+					if (!outputs[stream].limiter) {
+						fprintf (stderr, "Error: insufficient memory\n");
+						goto cleanup_rates;
+					}
+				}
+				for (unsigned int stream = 0; softclipopt->count && stream < numoutputs; stream++) {
+					outputs[stream].softclip = pow (10, softclipopt->dval[0] / 20);
+				}
+				sf_count_t outputlatency = lrint (oversampler_latency (&os) * rates.outputrate / rates.pluginrate) + limiter_latency (outputs[0].limiter);
+
+				/* all instances report the same latency, the first one is read */
+				const float* latencyport = latencyportidx >= 0 ? &controloutports[latencyportidx] : NULL;
+				sf_count_t   skip        = current_excerpt ? llround (current_excerpt->preroll * rates.outputrate / rates.filerate) : 0;
+
+				sf_count_t calibration = inputlength < DRYRUN_CALIBRATION * rates.filerate ? inputlength : llround (DRYRUN_CALIBRATION * rates.filerate);
+				for (unsigned int i = 0; dryrun.enabled && i < numinputs; i++) {
+					inputs[i].limited = true;
+					inputs[i].limit   = calibration;
+				}
+				if (dryrun.enabled) {
+					printf ("Note: Dry run, calibrating on the first %.1f seconds of the input.\n", calibration / rates.filerate);
+				}
+				struct timespec processing;
+				clock_gettime (CLOCK_MONOTONIC, &processing);
+				double cpustart = cpu_seconds ();
+
+				unsigned int numstarted = 0, numwriters = 0;
+				while (numstarted < numinputs && inputstream_start (&inputs[numstarted], blocksize)) {
+					numstarted++;
+				}
+				for (unsigned int i = 0; (statsopt->count || statsfile->count) && !dryrun.enabled && i < numoutputs; i++) {
+					if (!(outputs[i].stats = outputstats_new (outputs[i].numchannels, rates.outblocksize))) {
+						fprintf (stderr, "Error: insufficient memory for the statistics of %s\n", outputs[i].path);
+					}
+				}
+				while (numwriters < numoutputs && outputstream_start (&outputs[numwriters], rates.outblocksize)) {
+					numwriters++;
+				}
+				bool processed = false;
+				if (numstarted < numinputs || numwriters < numoutputs) {
+					fprintf (stderr, "Error: Unable to start the input and output threads\n");
 				} else {
-					process_check_clipping (blocksize, numchannels, numin, numout, numplugins, connections, pluginbuffers, outputbuffers, instances, &seq_in, seq_out, insndfile, outsndfile);
+					if (worldlock) {
+						pthread_mutex_unlock (&world_lock);
+					}
+					sf_count_t total = dryrun.enabled ? calibration : current_excerpt ? current_excerpt->preroll + current_excerpt->length : inputlength;
+					progress_start (&progress, follow->count || total <= 0 ? -1 : total, rates.filerate);
+					metrics_stage (&stagestart, METRIC_SETUP);
+					if (ignore_clipping->count) {
+						process_no_check_clipping (blocksize, numchannels, numin, numout, numatomin, numatomout, numplugins, coeffs, pluginbuffers, outputbuffers, instances, seq_in, midiports, seq_out, &midi, &os, &rates, &silence, &progress, outputlatency, skip, latencyport, numinputs, inputs, numoutputs, outputs);
+					} else {
+						process_check_clipping (blocksize, numchannels, numin, numout, numatomin, numatomout, numplugins, coeffs, pluginbuffers, outputbuffers, instances, seq_in, midiports, seq_out, &midi, &os, &rates, &silence, &progress, outputlatency, skip, latencyport, numinputs, inputs, numoutputs, outputs);
+					}
+					progress_stage (&progress, STAGE_FINISHING);
+					metrics_stage (&stagestart, METRIC_PROCESSING);
+					metrics_add (&metrics.frames, progress.frames);
+					metrics_add (&metrics.clipped, progress.clips);
+					jobstage  = METRIC_FINISHING;
+					processed = true;
+					if (worldlock) {
+						pthread_mutex_lock (&world_lock);
+					}
+				}
+				while (numstarted) {
+					inputstream_stop (&inputs[--numstarted]);
+				}
+				if (silence.enabled && silence.total) {
+					printf ("Note: Skipped %lld of %lld frames as silence (%.1f%%).\n", (long long)silence.skipped, (long long)silence.total, 100.0 * silence.skipped / silence.total);
+				}
+				while (numwriters) {
+					outputstream_stop (&outputs[--numwriters]);
+				}
+				for (unsigned int i = 0; i < numoutputs; i++) {
+					processed &= !outputs[i].failed;
+				}
+				if (processed) {
+					progress_stage (&progress, STAGE_DONE);
+					jobdone = true;
+				}
+				if (dryrun.enabled && calibration > 0) {
+					double scale   = (double)inputlength / calibration;
+					double wall    = startuptime / 1000 + elapsed_ms (&processing) / 1000 * scale;
+					double cpu     = startuptime / 1000 + (cpu_seconds () - cpustart) * scale;
+					size_t buffers = sizeof (float) * ((size_t)numplugins * (numin + numout) * blocksize * (factor > 1 ? 1 + factor : 1) + (size_t)numchannels * blocksize * (2 + READAHEAD_BLOCKS) + (size_t)numplugins * numout * rates.outblocksize * (WRITEBEHIND_BLOCKS + (rates.out != NULL))) + atomstride * numplugins * (numatomin + numatomout);
+					size_t plugins = 0;
+					for (unsigned int i = 0; i < numplugins; i++) {
+						plugins += hosted[i]->memory;
+					}
+					double bytes      = 0;
+					bool   compressed = false;
+					for (unsigned int i = 0; i < numoutputs; i++) {
+						const SF_INFO* info = &outputs[i].info;
+						unsigned int   size = sample_bytes (info->format);
+						/* FLAC and Ogg compress, the samples are an upper bound */
+						compressed |= !size || (info->format & SF_FORMAT_TYPEMASK) == SF_FORMAT_FLAC || (info->format & SF_FORMAT_TYPEMASK) == SF_FORMAT_OGG;
+						bytes += (double)llround (inputlength * rates.outputrate / rates.filerate) * info->channels * (size ? size : 4);
+					}
+					printf ("Estimate: %.1f s wall time, %.1f s CPU time, %.1f MB memory (%.1f MB buffers, %.1f MB plugin instances), %s%.1f MB output.\n", wall, cpu, (buffers + plugins) / 1048576.0, buffers / 1048576.0, plugins / 1048576.0, compressed ? "at most " : "", bytes / 1048576);
+					dryrun.numjobs++;
+					dryrun.wall += wall;
+					dryrun.cpu += cpu;
+					dryrun.memory = buffers + plugins > dryrun.memory ? buffers + plugins : dryrun.memory;
+					dryrun.bytes += bytes;
+					dryrun.compressed |= compressed;
+				} else if (dryrun.enabled) {
+					fprintf (stderr, "Error: The length of the input is unknown, the job can not be estimated.\n");
+				}
+				for (unsigned int i = 0; i < numoutputs && outputs[i].checksum.enabled; i++) {
+					uint32_t hash = checksum_finish (&outputs[i].checksum, outputs[i].numchannels);
+					if (outputs[i].checksum.failed) {
+						fprintf (stderr, "Error: insufficient memory for the checksum of %s\n", outputs[i].path);
+					} else if (checksumopt->count) {
+						printf ("Checksum: %08x %s (%zu blocks of %d frames)\n", hash, outputs[i].path, outputs[i].checksum.numblocks, CHECKSUM_FRAMES);
+					}
+				}
+				FILE* stats = processed && statsfile->count ? fopen (statsfile->filename[0], "a") : NULL;
+				if (processed && statsfile->count && !stats) {
+					fprintf (stderr, "Error: Unable to open %s: %s\n", statsfile->filename[0], strerror (errno));
+				}
+				if (processed && statsopt->count) {
+					placement_report ();
+				}
+				for (unsigned int i = 0; processed && i < numoutputs; i++) {
+					if (outputs[i].stats) {
+						outputstats_report (outputs[i].stats, outputs[i].path, outputs[i].info.samplerate, statsopt->count ? stdout : NULL, stats);
+					}
+				}
+				if (stats) {
+					fclose (stats);
+				}
+				if (compare_sink.fd >= 0) {
+					outputstream_send_checksums (compare_sink.fd, numoutputs, outputs);
+				}
+				if (current_excerpt && current_excerpt->join) {
+					preview_collect (current_excerpt, numoutputs, outputs);
 				}
+			cleanup_rates:
+				if (rates.in) {
+					resampler_free (rates.in);
+				}
+				if (rates.out) {
+					resampler_free (rates.out);
+				}
+				free (rates.resampled);
+				oversampler_free (&os);
+				free (atombuffers);
+				free (controlports);
 			}
 
-			//cleanup_lv2:
+		cleanup_instances:
 			for (unsigned int i = 0; i < numplugins; i++) {
-				lilv_instance_deactivate (instances[i]);
-				lilv_instance_free (instances[i]);
+				pool_release (hosted[i]);
 			}
 		}
 	cleanup_outfile:
-		if (sf_close (outsndfile)) {
-			fprintf (stderr, "Error closing output file!\n");
+		for (unsigned int i = 0; i < numoutputs; i++) {
+			outputstream_close (&outputs[i]);
+			outputstats_free (outputs[i].stats);
+			limiter_free (outputs[i].limiter);
 		}
+		free (outputs);
 	}
 
 cleanup_sndfile:
-	if (sf_close (insndfile)) {
-		fprintf (stderr, "Error closing input file!\n");
+	free (gains);
+	free (inmatrix);
+	free (outmatrix);
+	for (unsigned int i = 0; i < numinputs; i++) {
+		if (sf_close (inputs[i].file)) {
+			fprintf (stderr, "Error closing input file!\n");
+		}
 	}
+	free (midi.events);
 
 cleanup_lilvnodes:
 	lilv_node_free (input_class);
@@ -886,13 +5846,31 @@ cleanup_lilvnodes:
 	lilv_node_free (worker_iface_uri);
 
 cleanup_argtable:
+	progress_close (&progress);
+	if (isjob) {
+		metrics_stage (&stagestart, jobstage);
+		metrics_add (jobdone ? &metrics.jobs_completed : &metrics.jobs_failed, 1);
+		metrics_add (&metrics.jobs_running, -1);
+	}
+	if (metricsstarted) {
+		metrics_stop (&metricswriter);
+	}
 	arg_freetable (argtable, sizeof (argtable) / sizeof (argtable[0]));
 cleanup_listnamestable:
 	arg_freetable (listnamestable, sizeof (listnamestable) / sizeof (listnamestable[0]));
 cleanup_lilvworld:
-	lilv_world_free (lilvworld);
+	if (lilvworld != pool.world) {
+		lilv_world_free (lilvworld);
+	}
 cleanup_listtable:
 	arg_freetable (listtable, sizeof (listtable) / sizeof (listtable[0]));
+	arg_freetable (catalogtable, sizeof (catalogtable) / sizeof (catalogtable[0]));
 
-	free_uri_map ();
+	/* pooled instances keep the URIDs they were given */
+	if (!pool.world) {
+		free_uri_map ();
+	}
+	if (worldlock) {
+		pthread_mutex_unlock (&world_lock);
+	}
 }